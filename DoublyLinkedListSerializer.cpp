@@ -7,358 +7,6438 @@
  * - next: pointer to the next node in the list,
  * - rand: a random pointer to any node in the list or nullptr.
  *
- * - Utilizes modern C++ features (std::unique_ptr, std::make_unique, std::vector,
- *   std::unordered_map) for memory and collection management.
- * - Saves and restores the list in binary format.
+ * - Utilizes modern C++ features (std::unique_ptr, std::make_unique,
+ *   std::vector) for memory and collection management.
+ * - Allocates nodes from a block arena owned by the list.
+ * - Saves and restores the list in binary format, either interleaved per node
+ *   or as columnar sections (lengths, rand indices, payloads).
  * - Handles I/O errors using exceptions.
+ * - Buffers writes and can load a file through a read-only memory mapping.
  *
  * Eug
  * 2025-03-07
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <ranges>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 struct ListNode {
   ListNode *prev = nullptr;
   ListNode *next = nullptr;
   ListNode *rand = nullptr;
+  // Left empty by PayloadMode::Lazy loads, whose payload is in shared, so
+  // code that may see such nodes reads Payload() instead. MaterializePayloads
+  // copies every payload back into data.
   std::string data;
+  // Set instead of data by PayloadMode::Lazy loads: the payload lives in
+  // storage the List keeps alive (the loaded file or its dictionary).
+  std::string_view shared;
+  uint32_t index = 0; // position in the list, set as nodes are added
+
+  std::string_view Payload() const {
+    return shared.data() ? shared : std::string_view(data);
+  }
 };
 
-class List {
+// Carves ListNodes out of large blocks. Nodes are never freed one by one:
+// Release drops whole blocks, so a list costs O(blocks) deallocations.
+class NodeArena {
 public:
-  void Serialize(FILE *file); // fopen need for this task
-  void Deserialize(FILE *file);
+  ListNode *Allocate();
+  // Make sure the next n Allocate calls are served from a single block.
+  void Reserve(size_t n);
+  // n contiguous nodes in a block of their own.
+  ListNode *AllocateBlock(size_t n);
+  void Release();
 
-  void AddNode(const std::string &data);
-  void SetRand(int nodeIndex, int randIndex);
-  int GetCount() const { return count; }
-  void Clear();
-  void PrintList();
-  ~List();
+private:
+  static constexpr size_t kMinBlockNodes = 64;
+  static constexpr size_t kMaxBlockNodes = 64 * 1024;
+
+  void addBlock(size_t size);
+
+  struct Block {
+    std::unique_ptr<ListNode[]> nodes;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t used = 0; // nodes handed out from blocks.back()
+  size_t total = 0;
+};
+
+ListNode *NodeArena::Allocate() {
+  if (blocks.empty() || used == blocks.back().size) {
+    addBlock(std::clamp(total, kMinBlockNodes, kMaxBlockNodes));
+  }
+  return &blocks.back().nodes[used++];
+}
+
+void NodeArena::Reserve(size_t n) {
+  if (n > 0 && (blocks.empty() || blocks.back().size - used < n)) {
+    addBlock(n);
+  }
+}
+
+ListNode *NodeArena::AllocateBlock(size_t n) {
+  if (n == 0) {
+    return nullptr;
+  }
+  addBlock(n);
+  used = n;
+  return blocks.back().nodes.get();
+}
+
+void NodeArena::addBlock(size_t size) {
+  blocks.push_back(Block{std::make_unique<ListNode[]>(size), size});
+  used = 0;
+  total += size;
+}
+
+void NodeArena::Release() {
+  blocks.clear();
+  used = 0;
+  total = 0;
+}
+
+constexpr size_t kDefaultWriteBufferSize = 64 * 1024;
+constexpr uint32_t kDefaultChunkNodes = 64 * 1024;
+// Skip loads of regular files seek past each payload once they average this
+// many bytes; smaller ones are read through kSkipReadBufferSize at a time.
+constexpr uint64_t kSkipSeekMinPayload = 4 * 1024;
+constexpr size_t kSkipReadBufferSize = 1024 * 1024;
+
+// Interleaved: [count] then [len][bytes][rand] per node (the original format).
+// Columnar: a ColumnarHeader followed by all lengths, all rand indices and the
+// concatenated payloads, each as one contiguous section.
+enum class Format { Interleaved, Columnar };
+
+struct SerializeOptions {
+  size_t bufferSize = kDefaultWriteBufferSize; // bytes encoded per fwrite
+  Format format = Format::Interleaved;
+  // Nodes per entry of the columnar chunk offset table, 0 writes no table.
+  uint32_t chunkNodes = kDefaultChunkNodes;
+  // LEB128 lengths and rand indices instead of fixed 4 bytes, columnar only.
+  bool varint = false;
+  // Rand as a signed distance from its node, columnar only. Local rand
+  // pointers then fit in one varint byte.
+  bool randDelta = false;
+  // Store each distinct payload once and give nodes dictionary ids in the
+  // lengths section, columnar only. Needs threads == 1.
+  bool dictionary = false;
+  // LZ-compress the encoded stream in independent blocks of this many bytes
+  // (replaces bufferSize), 0 writes it raw. Needs threads == 1.
+  size_t compressBlockSize = 0;
+  // Interleaved and uncompressed only: end the list with an index footer
+  // holding the offset of every indexStride-th node, 0 writes none. Readers
+  // going through FILE* stop before the footer, so a file with an index
+  // should hold just the one list.
+  uint32_t indexStride = 0;
+  // Payloads of at least this many bytes are passed to writev/pwritev from
+  // the nodes' own storage instead of being copied into the buffer, 0
+  // copies all. Applies to FILE* and fd sinks; compressed output copies.
+  size_t gatherThreshold = 0;
+  // Encoder threads, 0 picks hardware_concurrency. Above 1 every thread
+  // pwrites its share of chunks at a precomputed offset, so the file must be
+  // seekable and not opened in append mode.
+  unsigned threads = 1;
+};
+
+// Copy: every node owns a std::string with its payload.
+// Lazy: nodes view their payload in the loaded bytes, which the List keeps
+// alive. With a mapped file no payload byte is read until it is accessed.
+// Interleaved files read through FILE* are always copied.
+// Skip: nodes keep empty data and payload bytes are seeked or stepped over,
+// so only the structure (order and rand pointers) is loaded.
+enum class PayloadMode { Copy, Lazy, Skip };
+
+struct DeserializeOptions {
+  // Worker threads for columnar files and compressed blocks, 0 picks
+  // hardware_concurrency. Interleaved files have no offsets to split on and
+  // load serially; compressed blocks read through FILE* are inflated one at
+  // a time as they stream in.
+  unsigned threads = 1;
+  PayloadMode payloads = PayloadMode::Copy;
+};
+
+// Where a kept node's rand pointer goes when its target was filtered out:
+// Null drops it, Follow chases the dropped target's own rand pointer until a
+// kept node turns up (nullptr if the chain ends or loops first).
+enum class DroppedRand { Null, Follow };
+
+// Decides from a node's position in the file and its payload whether a
+// filtered Deserialize keeps it.
+using NodeFilter = std::function<bool(size_t index, std::string_view data)>;
+
+// Columnar files start with this value where interleaved files keep their
+// node count. Counts come from an int, so they never have the high bit set.
+constexpr uint32_t kColumnarMagic = 0xD11C0105;
+constexpr uint32_t kColumnarVersion = 1;
+
+struct ColumnarHeader {
+  uint32_t magic = kColumnarMagic;
+  uint32_t version = kColumnarVersion;
+  uint32_t count = 0;
+  uint32_t flags = 0; // kColumnar* bits
+  uint64_t lengthsSize = 0; // bytes in the lengths section
+  uint64_t randsSize = 0;   // bytes in the rand index section
+  uint64_t payloadSize = 0; // bytes in the concatenated payload section
+};
+static_assert(sizeof(ColumnarHeader) == 40, "header is written as raw bytes");
+
+// The header is followed by [chunkNodes][chunkCount] and one ChunkOffsets per
+// chunkNodes nodes, so readers can start decoding at any chunk.
+constexpr uint32_t kColumnarChunkTable = 1u << 0;
+// Lengths and rand indices are LEB128 varints, rand stored as index + 1 with
+// 0 for nullptr; section sizes in the header are byte counts.
+constexpr uint32_t kColumnarVarint = 1u << 1;
+// Rand stored as zigzag(rand - index) + 1, with 0 for nullptr.
+constexpr uint32_t kColumnarRandDelta = 1u << 2;
+// The lengths section holds dictionary ids and the payload section is
+// [entryCount], one length per entry, then the entries' bytes. Length and id
+// fields follow kColumnarVarint. Chunk payload offsets are 0.
+constexpr uint32_t kColumnarDictionary = 1u << 3;
+constexpr uint32_t kColumnarKnownFlags = kColumnarChunkTable | kColumnarVarint |
+                                         kColumnarRandDelta |
+                                         kColumnarDictionary;
+
+// Where a chunk's first node starts, relative to the start of each section.
+struct ChunkOffsets {
+  uint64_t lengths = 0;
+  uint64_t rands = 0;
+  uint64_t payload = 0;
+};
+static_assert(sizeof(ChunkOffsets) == 24, "entries are written as raw bytes");
+
+struct ChunkTable {
+  uint32_t chunkNodes = 0;
+  std::vector<ChunkOffsets> chunks;
+};
+
+// An interleaved file may end with an index footer: the uint64 offset from
+// the start of the list of every indexStride-th node, then [indexStride]
+// [entryCount][kIndexMagic]. Without a footer the last four bytes are the
+// final node's rand index, which is -1 or in [0, count); read as an int32 the
+// magic is a negative value other than -1, so it can never be mistaken for one.
+constexpr uint32_t kIndexMagic = 0xD11C1DE5;
+// Stride of the index built in memory for files that carry none.
+constexpr uint32_t kDefaultIndexStride = 1024;
+
+// Runs task(begin, end) on `threads` contiguous slices of [0, n) and waits for
+// all of them. The first exception thrown by a slice is rethrown here.
+template <typename Task>
+void parallelFor(size_t n, unsigned threads, const Task &task) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  size_t slices = std::min<size_t>(threads, n);
+  if (slices <= 1) {
+    if (n > 0) {
+      task(size_t{0}, n);
+    }
+    return;
+  }
+
+  std::vector<std::exception_ptr> errors(slices);
+  std::vector<std::thread> workers;
+  workers.reserve(slices);
+  for (size_t t = 0; t < slices; t++) {
+    workers.emplace_back([&, t] {
+      try {
+        task(n * t / slices, n * (t + 1) / slices);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  for (const std::exception_ptr &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// Compressed files start with this magic and the block size, followed by
+// [rawSize][packedSize][bytes] per block and a rawSize of 0 at the end. Each
+// block decompresses on its own; packedSize == rawSize means stored as is.
+// The decompressed blocks form an interleaved or columnar stream.
+constexpr uint32_t kCompressedMagic = 0xD11C0C2B;
+
+// LZ77 in the style of LZ4. Each sequence is a token (literal length in the
+// high nibble, match length - 4 in the low one, 15 meaning more length bytes
+// of 255 follow), the literals, and a 2 byte match offset. The last sequence
+// has literals only.
+constexpr size_t kLzMinMatch = 4;
+constexpr size_t kLzHashBits = 14;
+constexpr size_t kLzMaxOffset = 0xFFFF;
+
+void lzWriteLength(std::vector<char> &out, size_t length) {
+  while (length >= 255) {
+    out.push_back(static_cast<char>(255));
+    length -= 255;
+  }
+  out.push_back(static_cast<char>(length));
+}
+
+void lzWriteSequence(std::vector<char> &out, const char *literals,
+                     size_t literalLength, size_t offset, size_t matchLength) {
+  size_t matchCode = matchLength > 0 ? matchLength - kLzMinMatch : 0;
+  out.push_back(static_cast<char>((std::min<size_t>(literalLength, 15) << 4) |
+                                  std::min<size_t>(matchCode, 15)));
+  if (literalLength >= 15) {
+    lzWriteLength(out, literalLength - 15);
+  }
+  out.insert(out.end(), literals, literals + literalLength);
+  if (matchLength == 0) {
+    return;
+  }
+  out.push_back(static_cast<char>(offset & 0xFF));
+  out.push_back(static_cast<char>(offset >> 8));
+  if (matchCode >= 15) {
+    lzWriteLength(out, matchCode - 15);
+  }
+}
+
+size_t lzCompress(const char *src, size_t size, std::vector<char> &out) {
+  out.clear();
+  out.reserve(size + size / 255 + 16);
+  std::vector<uint32_t> table(size_t{1} << kLzHashBits, 0);
+
+  auto load32 = [src](size_t at) {
+    uint32_t value = 0;
+    memcpy(&value, src + at, sizeof(value));
+    return value;
+  };
+
+  // Matches stop short of the end so the last bytes always go out as
+  // literals and the finder never reads past src + size.
+  size_t anchor = 0;
+  size_t pos = 0;
+  size_t limit = size > 12 ? size - 12 : 0;
+  while (pos < limit) {
+    uint32_t sequence = load32(pos);
+    size_t slot = (sequence * 2654435761u) >> (32 - kLzHashBits);
+    size_t candidate = table[slot];
+    table[slot] = static_cast<uint32_t>(pos);
+
+    if (candidate < pos && pos - candidate <= kLzMaxOffset &&
+        load32(candidate) == sequence) {
+      size_t length = kLzMinMatch;
+      while (pos + length < size - 5 &&
+             src[candidate + length] == src[pos + length]) {
+        length++;
+      }
+      lzWriteSequence(out, src + anchor, pos - anchor, pos - candidate,
+                      length);
+      pos += length;
+      anchor = pos;
+    } else {
+      pos++;
+    }
+  }
+  lzWriteSequence(out, src + anchor, size - anchor, 0, 0);
+  return out.size();
+}
+
+// The most bytes packedSize bytes can inflate to: every length byte of 255
+// adds 255, plus one sequence's worth of slack.
+constexpr uint64_t lzMaxInflatedSize(uint64_t packedSize) {
+  return packedSize * 255 + 16;
+}
+
+void lzDecompress(const char *src, size_t size, char *dst, size_t rawSize) {
+  const char *in = src;
+  const char *end = src + size;
+  size_t produced = 0;
+  auto fail = [] {
+    throw std::runtime_error("Corrupt compressed block...stopped");
+  };
+  auto readLength = [&](size_t length) {
+    if (length < 15) {
+      return length;
+    }
+    uint8_t byte = 0;
+    do {
+      if (in == end) {
+        fail();
+      }
+      byte = static_cast<uint8_t>(*in++);
+      length += byte;
+    } while (byte == 255);
+    return length;
+  };
+
+  for (;;) {
+    if (in == end) {
+      fail();
+    }
+    uint8_t token = static_cast<uint8_t>(*in++);
+
+    size_t literalLength = readLength(token >> 4);
+    if (literalLength > static_cast<size_t>(end - in) ||
+        literalLength > rawSize - produced) {
+      fail();
+    }
+    memcpy(dst + produced, in, literalLength);
+    in += literalLength;
+    produced += literalLength;
+    if (in == end) {
+      break;
+    }
+
+    if (end - in < 2) {
+      fail();
+    }
+    size_t offset = static_cast<uint8_t>(in[0]) |
+                    (size_t{static_cast<uint8_t>(in[1])} << 8);
+    in += 2;
+    size_t matchLength = readLength(token & 0x0F) + kLzMinMatch;
+    if (offset == 0 || offset > produced || matchLength > rawSize - produced) {
+      fail();
+    }
+    // Byte by byte: the match may overlap the bytes it is producing.
+    for (size_t i = 0; i < matchLength; i++) {
+      dst[produced + i] = dst[produced + i - offset];
+    }
+    produced += matchLength;
+  }
+
+  if (produced != rawSize) {
+    fail();
+  }
+}
+
+// A sink stores the bytes a WriteBuffer flushes and returns how many it
+// took, fewer than size meaning the write failed. WriteBuffer and the
+// encoders are instantiated per sink type, so encoding stays memcpy into
+// the buffer plus one direct call per flush.
+template <typename T>
+concept ByteSink = requires(T sink, const char *bytes, size_t size) {
+  { sink.Write(bytes, size) } -> std::same_as<size_t>;
+};
+
+// A sink that also takes a gather list, so WriteBuffer can hand it large
+// payloads in place instead of copying them into the buffer. WriteVector
+// may modify pieces.
+template <typename T>
+concept GatherSink = ByteSink<T> && requires(T sink, iovec *pieces, int n) {
+  { sink.WriteVector(pieces, n) } -> std::same_as<size_t>;
+};
+
+// Most pieces a gather list passes in one call, Linux's UIO_MAXIOV.
+constexpr int kMaxGatherPieces = 1024;
+
+class FileSink {
+public:
+  explicit FileSink(FILE *file) : file(file) {}
+  size_t Write(const char *bytes, size_t size) {
+    return fwrite(bytes, 1, size, file);
+  }
 
 private:
-  static uint32_t readUint32(FILE *file);
-  static std::unique_ptr<ListNode> readNode(FILE *file, int32_t &outRandIndex);
-  static void setupLinks(const std::vector<ListNode *> &nodes);
-  static void setupRandPointers(const std::vector<ListNode *> &nodes,
-                                const std::vector<int32_t> &randIndices);
+  FILE *file;
+};
 
-  ListNode *head = nullptr;
-  ListNode *tail = nullptr;
-  int count = 0;
+// write(2) on a descriptor, for pipes and sockets without stdio.
+class FdSink {
+public:
+  explicit FdSink(int fd) : fd(fd) {}
+  size_t Write(const char *bytes, size_t size);
+  size_t WriteVector(iovec *pieces, int count);
+
+private:
+  int fd;
 };
 
-void List::AddNode(const std::string &data) {
-  ListNode *newNode = new ListNode();
-  newNode->data = data;
+// pwrite(2) to consecutive positions of fd from offset on.
+class PwriteSink {
+public:
+  PwriteSink(int fd, off_t offset) : fd(fd), offset(offset) {}
+  size_t Write(const char *bytes, size_t size);
+  size_t WriteVector(iovec *pieces, int count);
+  off_t GetOffset() const { return offset; }
 
-  if (!head) {
-    head = newNode;
-    tail = newNode;
+private:
+  int fd;
+  off_t offset;
+};
+
+// Appends to a vector of char or std::byte owned by the caller.
+template <typename Byte> class MemorySink {
+public:
+  explicit MemorySink(std::vector<Byte> &bytes) : bytes(bytes) {}
+  size_t Write(const char *data, size_t size) {
+    const Byte *begin = reinterpret_cast<const Byte *>(data);
+    bytes.insert(bytes.end(), begin, begin + size);
+    return size;
+  }
+
+private:
+  std::vector<Byte> &bytes;
+};
+
+// Fills a fixed region, such as a writable mapping, and fails once full.
+class SpanSink {
+public:
+  SpanSink(char *begin, size_t size) : pos(begin), end(begin + size) {}
+  size_t Write(const char *bytes, size_t size) {
+    size = std::min(size, static_cast<size_t>(end - pos));
+    memcpy(pos, bytes, size);
+    pos += size;
+    return size;
+  }
+
+private:
+  char *pos;
+  char *end;
+};
+
+// Keeps only the byte count, to size an output before producing it.
+// kSizeOnly lets WriteBuffer pass sizes straight through, without copying.
+class CountingSink {
+public:
+  static constexpr bool kSizeOnly = true;
+  size_t Write(const char *, size_t size) {
+    count += size;
+    return size;
+  }
+  uint64_t GetCount() const { return count; }
+
+private:
+  uint64_t count = 0;
+};
+
+// Runs write(bytes, size) until all of size is written, returns the total.
+template <typename WriteCall>
+size_t writeFully(const char *bytes, size_t size, const WriteCall &write) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result = write(bytes + written, size - written, written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    written += static_cast<size_t>(result);
+  }
+  return written;
+}
+
+// Runs write(pieces, count, done) until every piece is written, advancing
+// pieces past partial writes. Returns the total.
+template <typename WriteCall>
+size_t writeVectorFully(iovec *pieces, int count, const WriteCall &write) {
+  size_t written = 0;
+  int first = 0;
+  while (first < count) {
+    ssize_t result = write(pieces + first, count - first, written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    written += static_cast<size_t>(result);
+    size_t left = static_cast<size_t>(result);
+    while (first < count && left >= pieces[first].iov_len) {
+      left -= pieces[first].iov_len;
+      first++;
+    }
+    if (left > 0) {
+      pieces[first].iov_base = static_cast<char *>(pieces[first].iov_base) +
+                               left;
+      pieces[first].iov_len -= left;
+    }
+  }
+  return written;
+}
+
+size_t FdSink::Write(const char *bytes, size_t size) {
+  return writeFully(bytes, size, [this](const char *at, size_t n, size_t) {
+    return write(fd, at, n);
+  });
+}
+
+size_t FdSink::WriteVector(iovec *pieces, int count) {
+  return writeVectorFully(pieces, count, [this](iovec *at, int n, size_t) {
+    return writev(fd, at, n);
+  });
+}
+
+size_t PwriteSink::Write(const char *bytes, size_t size) {
+  size_t written =
+      writeFully(bytes, size, [this](const char *at, size_t n, size_t done) {
+        return pwrite(fd, at, n, offset + static_cast<off_t>(done));
+      });
+  offset += static_cast<off_t>(written);
+  return written;
+}
+
+size_t PwriteSink::WriteVector(iovec *pieces, int count) {
+  size_t written =
+      writeVectorFully(pieces, count, [this](iovec *at, int n, size_t done) {
+        return pwritev(fd, at, n, offset + static_cast<off_t>(done));
+      });
+  offset += static_cast<off_t>(written);
+  return written;
+}
+
+// Double buffering in front of target: Write copies into one buffer while an
+// I/O thread writes the other to target. A failed write shows up as a short
+// Write here, or from the future if it was the last block.
+template <ByteSink Sink> class AsyncSink {
+public:
+  AsyncSink(Sink target, size_t capacity);
+  ~AsyncSink();
+  AsyncSink(const AsyncSink &) = delete;
+  AsyncSink &operator=(const AsyncSink &) = delete;
+
+  size_t Write(const char *bytes, size_t size);
+  // Hands over the last bytes. The future is ready once the I/O thread
+  // wrote them and ran finish on the target, and holds what finish throws.
+  // Like any std::async future, dropping it waits for it.
+  std::future<void> Finish(std::function<void(Sink &)> finish);
+
+private:
+  // Shared with the I/O thread, which may outlive the AsyncSink.
+  struct State {
+    Sink target;
+    std::vector<char> writing; // the I/O thread's while busy
+    std::function<void(Sink &)> finish;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool busy = false;
+    bool done = false;
+    bool failed = false;
+  };
+
+  void handOff();
+  static void writeBlocks(State &state);
+
+  std::shared_ptr<State> state;
+  size_t capacity;
+  std::vector<char> filling; // the encoder's
+  std::future<void> io;
+};
+
+template <ByteSink Sink>
+AsyncSink<Sink>::AsyncSink(Sink target, size_t capacity)
+    : state(std::make_shared<State>(std::move(target))),
+      capacity(std::max<size_t>(capacity, 1)) {
+  filling.reserve(this->capacity);
+  state->writing.reserve(this->capacity);
+  io = std::async(std::launch::async,
+                  [shared = state] { writeBlocks(*shared); });
+}
+
+template <ByteSink Sink> AsyncSink<Sink>::~AsyncSink() {
+  if (!io.valid()) {
+    return;
+  }
+  {
+    // Abandoned mid-list: write nothing more, don't run finish.
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->done = true;
+    state->failed = true;
+  }
+  state->changed.notify_all();
+  io.wait();
+}
+
+template <ByteSink Sink>
+size_t AsyncSink<Sink>::Write(const char *bytes, size_t size) {
+  size_t taken = 0;
+  while (taken < size) {
+    if (filling.size() == capacity) {
+      handOff();
+    }
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->failed) {
+        return taken;
+      }
+    }
+    size_t chunk = std::min(size - taken, capacity - filling.size());
+    filling.insert(filling.end(), bytes + taken, bytes + taken + chunk);
+    taken += chunk;
+  }
+  return taken;
+}
+
+template <ByteSink Sink>
+std::future<void> AsyncSink<Sink>::Finish(std::function<void(Sink &)> finish) {
+  if (!filling.empty()) {
+    handOff();
+  }
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->finish = std::move(finish);
+    state->done = true;
+  }
+  state->changed.notify_all();
+  return std::move(io);
+}
+
+// Waits for the I/O thread to take the previous block, then gives it this
+// one.
+template <ByteSink Sink> void AsyncSink<Sink>::handOff() {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->changed.wait(lock, [this] { return !state->busy; });
+  std::swap(filling, state->writing);
+  filling.clear();
+  state->busy = true;
+  lock.unlock();
+  state->changed.notify_all();
+}
+
+template <ByteSink Sink> void AsyncSink<Sink>::writeBlocks(State &state) {
+  std::unique_lock<std::mutex> lock(state.mutex);
+  for (;;) {
+    state.changed.wait(lock, [&state] { return state.busy || state.done; });
+    if (!state.busy) {
+      break;
+    }
+    bool skip = state.failed;
+    lock.unlock();
+    const std::vector<char> &block = state.writing;
+    bool written =
+        skip || state.target.Write(block.data(), block.size()) == block.size();
+    lock.lock();
+    state.failed = state.failed || !written;
+    state.busy = false;
+    state.changed.notify_all();
+  }
+  if (state.failed) {
+    throw std::runtime_error("Error writing list...stopped");
+  }
+  lock.unlock();
+  if (state.finish) {
+    state.finish(state.target);
+  }
+}
+
+// Collects encoded fields in memory and hands them to the sink in blocks of
+// the configured size. Every field keeps its error message, so a failed flush
+// reports the same error the field-by-field writer would have raised.
+template <ByteSink Sink> class WriteBuffer {
+public:
+  // With a GatherSink, Reference passes fields of at least gatherThreshold
+  // bytes to the sink in place; 0 copies everything.
+  WriteBuffer(Sink &sink, size_t capacity, size_t gatherThreshold = 0)
+      : sink(sink), buffer(std::max<size_t>(capacity, 1)),
+        gatherThreshold(gatherThreshold) {}
+
+  void Write(const void *bytes, size_t size, const char *errorMessage);
+  // Like Write, but large fields are written from bytes itself at the next
+  // flush, so they must stay unchanged until then.
+  void Reference(const void *bytes, size_t size, const char *errorMessage);
+  void Flush();
+  size_t GetFlushCount() const { return flushCount; }
+
+  // Between these calls every flush emits one compressed block of at most
+  // the buffer capacity, framed as described at kCompressedMagic.
+  void BeginCompressedBlocks();
+  void EndCompressedBlocks();
+
+private:
+  size_t writePending();
+  void flushCompressed();
+  void addField(const char *errorMessage);
+
+  Sink &sink;
+  std::vector<char> buffer;
+  size_t used = 0;
+  size_t pending = 0; // used plus referenced bytes
+  size_t flushCount = 0;
+  bool compress = false;
+  std::vector<char> packed; // compressed copy of buffer
+  size_t gatherThreshold = 0;
+  // Gather list for the next flush, ending where buffer bytes from
+  // gathered onwards are still to be added.
+  std::vector<iovec> pieces;
+  size_t gathered = 0;
+  // End offset in the pending bytes of each field and the message to
+  // report if the sink stops before that offset.
+  std::vector<std::pair<size_t, const char *>> fields;
+};
+
+template <ByteSink Sink>
+void WriteBuffer<Sink>::Write(const void *bytes, size_t size,
+                              const char *errorMessage) {
+  const char *src = static_cast<const char *>(bytes);
+  if constexpr (requires { Sink::kSizeOnly; }) {
+    if (!compress) { // compressed sizes need the bytes
+      sink.Write(src, size);
+      return;
+    }
+  }
+  while (size > 0) {
+    if (used == buffer.size()) {
+      Flush();
+    }
+
+    size_t chunk = std::min(size, buffer.size() - used);
+    memcpy(buffer.data() + used, src, chunk);
+    used += chunk;
+    pending += chunk;
+    src += chunk;
+    size -= chunk;
+    addField(errorMessage);
+  }
+}
+
+template <ByteSink Sink>
+void WriteBuffer<Sink>::Reference(const void *bytes, size_t size,
+                                  const char *errorMessage) {
+  if constexpr (GatherSink<Sink>) {
+    if (gatherThreshold > 0 && size >= gatherThreshold && !compress) {
+      // Room for buffer bytes before and after bytes, the latter at Flush.
+      if (pieces.size() + 3 > kMaxGatherPieces) {
+        Flush();
+      }
+      if (used > gathered) {
+        pieces.push_back(iovec{buffer.data() + gathered, used - gathered});
+        gathered = used;
+      }
+      pieces.push_back(iovec{const_cast<void *>(bytes), size});
+      pending += size;
+      addField(errorMessage);
+      return;
+    }
+  }
+  Write(bytes, size, errorMessage);
+}
+
+template <ByteSink Sink> size_t WriteBuffer<Sink>::writePending() {
+  if constexpr (GatherSink<Sink>) {
+    if (!pieces.empty()) {
+      if (used > gathered) {
+        pieces.push_back(iovec{buffer.data() + gathered, used - gathered});
+      }
+      size_t written =
+          sink.WriteVector(pieces.data(), static_cast<int>(pieces.size()));
+      pieces.clear();
+      gathered = 0;
+      return written;
+    }
+  }
+  return sink.Write(buffer.data(), used);
+}
+
+template <ByteSink Sink>
+void WriteBuffer<Sink>::addField(const char *errorMessage) {
+  if (!fields.empty() && fields.back().second == errorMessage) {
+    fields.back().first = pending;
   } else {
-    tail->next = newNode;
-    newNode->prev = tail;
-    tail = newNode;
+    fields.emplace_back(pending, errorMessage);
+  }
+}
+
+template <ByteSink Sink> void WriteBuffer<Sink>::Flush() {
+  if (pending == 0) {
+    return;
   }
 
-  count++;
+  if (compress) {
+    flushCompressed();
+    return;
+  }
+
+  size_t written = writePending();
+  flushCount++;
+  if (written != pending) {
+    for (const auto &field : fields) {
+      if (field.first > written) {
+        throw std::runtime_error(field.second);
+      }
+    }
+  }
+
+  used = 0;
+  pending = 0;
+  fields.clear();
 }
-void List::Serialize(FILE *file) {
-  if (!file) {
-    throw std::runtime_error("File not open for writing...stopped");
+
+// Read-only mapping of a whole file, unmapped on destruction.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path);
+  explicit MappedFile(int fd);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *Data() const { return static_cast<const char *>(address); }
+  size_t Size() const { return size; }
+
+private:
+  void map(int fd);
+
+  void *address = nullptr;
+  size_t size = 0;
+};
+
+MappedFile::MappedFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Can't open file for mapping...stopped");
+  }
+  try {
+    map(fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd); // the mapping stays valid after close
+}
+
+MappedFile::MappedFile(int fd) { map(fd); }
+
+void MappedFile::map(int fd) {
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    throw std::runtime_error("Can't stat file for mapping...stopped");
   }
 
-  uint32_t ucount = static_cast<uint32_t>(count);
-  if (fwrite(&ucount, sizeof(ucount), 1, file) != 1) {
-    throw std::runtime_error("Error writing count...stopped");
+  size = static_cast<size_t>(info.st_size);
+  if (size == 0) {
+    return; // mmap rejects empty ranges, an empty view is enough
+  }
+
+  address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (address == MAP_FAILED) {
+    address = nullptr;
+    throw std::runtime_error("Can't map file...stopped");
+  }
+  madvise(address, size, MADV_SEQUENTIAL);
+}
+
+MappedFile::~MappedFile() {
+  if (address) {
+    munmap(address, size);
+  }
+}
+
+// Cursor over a serialized list held in memory. Running past the end raises
+// the same errors as the fread-based readers.
+class ByteReader {
+public:
+  ByteReader(const char *begin, const char *end) : pos(begin), end(end) {}
+
+  uint32_t ReadUint32();
+  uint64_t ReadUint64();
+  int32_t ReadInt32(const char *errorMessage);
+  const char *ReadBytes(size_t size, const char *errorMessage);
+  size_t Remaining() const { return static_cast<size_t>(end - pos); }
+
+private:
+  const char *pos;
+  const char *end;
+};
+
+uint32_t ByteReader::ReadUint32() {
+  uint32_t value = 0;
+  memcpy(&value,
+         ReadBytes(sizeof(value), "Error reading uint32_t value...stopped"),
+         sizeof(value));
+  return value;
+}
+
+uint64_t ByteReader::ReadUint64() {
+  uint64_t value = 0;
+  memcpy(&value,
+         ReadBytes(sizeof(value), "Error reading uint64_t value...stopped"),
+         sizeof(value));
+  return value;
+}
+
+int32_t ByteReader::ReadInt32(const char *errorMessage) {
+  int32_t value = 0;
+  memcpy(&value, ReadBytes(sizeof(value), errorMessage), sizeof(value));
+  return value;
+}
+
+const char *ByteReader::ReadBytes(size_t size, const char *errorMessage) {
+  if (size > Remaining()) {
+    throw std::runtime_error(errorMessage);
+  }
+  const char *bytes = pos;
+  pos += size;
+  return bytes;
+}
+
+// LEB128: seven bits per byte, the high bit set on all but the last byte.
+constexpr size_t kMaxVarintSize = 5;
+
+size_t varintSize(uint32_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+size_t encodeVarint(uint32_t value, char *out) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = static_cast<char>((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  out[size++] = static_cast<char>(value);
+  return size;
+}
+
+// Decodes n varints from [pos, end) and returns the position after the last.
+// Short payloads make most values one byte, so eight bytes are tested at once
+// and a run without continuation bits is copied out as eight values.
+const char *decodeVarints(const char *pos, const char *end, uint32_t *out,
+                          size_t n) {
+  constexpr uint64_t kContinuationBits = 0x8080808080808080ull;
+  size_t i = 0;
+  while (i < n) {
+    if (n - i >= 8 && end - pos >= 8) {
+      uint64_t word = 0;
+      memcpy(&word, pos, sizeof(word));
+      if ((word & kContinuationBits) == 0) {
+        for (size_t k = 0; k < 8; k++) {
+          out[i + k] = static_cast<uint8_t>(word >> (8 * k));
+        }
+        i += 8;
+        pos += 8;
+        continue;
+      }
+    }
+
+    uint32_t value = 0;
+    for (size_t shift = 0;; shift += 7) {
+      if (pos == end || shift >= 7 * kMaxVarintSize) {
+        throw std::runtime_error("Error reading varint...stopped");
+      }
+      uint8_t byte = static_cast<uint8_t>(*pos++);
+      if (shift == 28 && byte > 0x0F) {
+        throw std::runtime_error("Error reading varint...stopped");
+      }
+      value |= uint32_t{byte & 0x7Fu} << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    out[i++] = value;
+  }
+  return pos;
+}
+
+template <ByteSink Sink> void WriteBuffer<Sink>::BeginCompressedBlocks() {
+  Flush();
+  uint32_t head[2] = {kCompressedMagic, static_cast<uint32_t>(buffer.size())};
+  if (sink.Write(reinterpret_cast<const char *>(head), sizeof(head)) !=
+      sizeof(head)) {
+    throw std::runtime_error("Error writing compression header...stopped");
+  }
+  compress = true;
+}
+
+template <ByteSink Sink> void WriteBuffer<Sink>::EndCompressedBlocks() {
+  Flush();
+  compress = false;
+  uint32_t terminator = 0;
+  if (sink.Write(reinterpret_cast<const char *>(&terminator),
+                 sizeof(terminator)) != sizeof(terminator)) {
+    throw std::runtime_error("Error writing compression header...stopped");
+  }
+}
+
+template <ByteSink Sink> void WriteBuffer<Sink>::flushCompressed() {
+  size_t packedSize = lzCompress(buffer.data(), used, packed);
+  bool stored = packedSize >= used;
+  uint32_t head[2] = {static_cast<uint32_t>(used),
+                      static_cast<uint32_t>(stored ? used : packedSize)};
+  const char *body = stored ? buffer.data() : packed.data();
+
+  bool written =
+      sink.Write(reinterpret_cast<const char *>(head), sizeof(head)) ==
+          sizeof(head) &&
+      sink.Write(body, head[1]) == head[1];
+  flushCount++;
+  if (!written) {
+    // Compressed bytes don't map back to fields, blame the block's first one.
+    throw std::runtime_error(fields.front().second);
+  }
+
+  used = 0;
+  pending = 0;
+  fields.clear();
+}
+
+// Reads the blocks that follow kCompressedMagic and decompresses them, in
+// parallel, into one buffer holding the original stream.
+std::vector<char> inflateBlocks(ByteReader &in, unsigned threads) {
+  struct Block {
+    const char *bytes;
+    uint32_t rawSize;
+    uint32_t packedSize;
+    size_t outOffset;
+  };
+
+  uint32_t blockSize = in.ReadUint32();
+  std::vector<Block> blocks;
+  size_t total = 0;
+  for (;;) {
+    uint32_t rawSize = in.ReadUint32();
+    if (rawSize == 0) {
+      break;
+    }
+    uint32_t packedSize = in.ReadUint32();
+    if (rawSize > blockSize || packedSize > rawSize ||
+        rawSize > lzMaxInflatedSize(packedSize)) {
+      throw std::runtime_error("Corrupt compressed block...stopped");
+    }
+    const char *bytes =
+        in.ReadBytes(packedSize, "Error reading compressed block...stopped");
+    blocks.push_back(Block{bytes, rawSize, packedSize, total});
+    total += rawSize;
+  }
+
+  std::vector<char> out(total);
+  parallelFor(blocks.size(), threads, [&](size_t b0, size_t b1) {
+    for (size_t b = b0; b < b1; b++) {
+      const Block &block = blocks[b];
+      if (block.packedSize == block.rawSize) {
+        memcpy(out.data() + block.outOffset, block.bytes, block.rawSize);
+      } else {
+        lzDecompress(block.bytes, block.packedSize,
+                     out.data() + block.outOffset, block.rawSize);
+      }
+    }
+  });
+  return out;
+}
+
+// A source copies up to size bytes of its stream into bytes and returns how
+// many, 0 at the end. kReadAhead tells ReadBuffer whether it may fetch more
+// than asked; sources sharing a position with other readers must not.
+template <typename T>
+concept ByteSource = requires(T source, char *bytes, size_t size) {
+  { source.Read(bytes, size) } -> std::same_as<size_t>;
+  { T::kReadAhead } -> std::convertible_to<bool>;
+};
+
+class FileSource {
+public:
+  static constexpr bool kReadAhead = false; // stdio buffers on its own
+  explicit FileSource(FILE *file) : file(file) {}
+  size_t Read(char *bytes, size_t size) {
+    return fread(bytes, 1, size, file);
+  }
+
+private:
+  FILE *file;
+};
+
+// read(2) on a descriptor, for pipes and sockets without stdio.
+class FdSource {
+public:
+  static constexpr bool kReadAhead = true;
+  explicit FdSource(int fd) : fd(fd) {}
+  size_t Read(char *bytes, size_t size);
+
+private:
+  int fd;
+};
+
+// pread(2) from consecutive positions of fd, never past size bytes.
+class PreadSource {
+public:
+  static constexpr bool kReadAhead = true;
+  PreadSource(int fd = -1, off_t offset = 0, uint64_t size = 0)
+      : fd(fd), offset(offset), remaining(size) {}
+  size_t Read(char *bytes, size_t size);
+
+private:
+  int fd;
+  off_t offset;
+  uint64_t remaining;
+};
+
+size_t FdSource::Read(char *bytes, size_t size) {
+  for (;;) {
+    ssize_t result = read(fd, bytes, size);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    return result > 0 ? static_cast<size_t>(result) : 0;
+  }
+}
+
+size_t PreadSource::Read(char *bytes, size_t size) {
+  size = static_cast<size_t>(std::min<uint64_t>(size, remaining));
+  size_t got = 0;
+  while (got < size) {
+    ssize_t result = pread(fd, bytes + got, size - got, offset + got);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    got += static_cast<size_t>(result);
+  }
+  offset += static_cast<off_t>(got);
+  remaining -= got;
+  return got;
+}
+
+// Passes reads through to source, but never lets a ReadBuffer ask for more
+// than it needs, so whatever follows stays in source for the next reader.
+template <ByteSource Source> class ExactSource {
+public:
+  static constexpr bool kReadAhead = false;
+  explicit ExactSource(Source &source) : source(source) {}
+  size_t Read(char *bytes, size_t size) { return source.Read(bytes, size); }
+
+private:
+  Source &source;
+};
+
+// Hands out a byte stream in pieces, straight from the source or from the
+// blocks of a compressed container inflated one at a time. The buffer only
+// grows to fit the largest single Read.
+template <ByteSource Source> class ReadBuffer {
+public:
+  ReadBuffer(Source &source, size_t capacity)
+      : source(source), buffer(std::max<size_t>(capacity, 1)) {}
+
+  // size contiguous bytes, valid until the next call.
+  const char *Read(size_t size, const char *errorMessage);
+  // Drops size bytes without growing the buffer.
+  void Skip(uint64_t size, const char *errorMessage);
+
+  // Called after kCompressedMagic, inflates blocks from here on. End reads
+  // up to and including the terminating block.
+  void BeginCompressedBlocks();
+  void EndCompressedBlocks();
+
+private:
+  bool fill(size_t size);
+  bool inflateBlock();
+  bool readExactly(void *bytes, size_t size);
+
+  Source &source;
+  std::vector<char> buffer;
+  size_t pos = 0;
+  size_t end = 0;
+  bool compress = false;
+  uint32_t blockSize = 0;
+  std::vector<char> packed; // current compressed block
+};
+
+template <ByteSource Source>
+const char *ReadBuffer<Source>::Read(size_t size, const char *errorMessage) {
+  if (size > end - pos && !fill(size)) {
+    throw std::runtime_error(errorMessage);
+  }
+  const char *bytes = buffer.data() + pos;
+  pos += size;
+  return bytes;
+}
+
+template <ByteSource Source>
+void ReadBuffer<Source>::Skip(uint64_t size, const char *errorMessage) {
+  for (;;) {
+    size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, end - pos));
+    pos += chunk;
+    size -= chunk;
+    if (size == 0) {
+      return;
+    }
+    if (!fill(static_cast<size_t>(
+            std::min<uint64_t>(size, buffer.size())))) {
+      throw std::runtime_error(errorMessage);
+    }
+  }
+}
+
+template <ByteSource Source> bool ReadBuffer<Source>::fill(size_t size) {
+  // Keep the unread bytes and make room for size of them.
+  memmove(buffer.data(), buffer.data() + pos, end - pos);
+  end -= pos;
+  pos = 0;
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+
+  while (end < size) {
+    if (compress) {
+      if (!inflateBlock()) {
+        return false;
+      }
+      continue;
+    }
+    size_t wanted = Source::kReadAhead ? buffer.size() - end : size - end;
+    size_t got = source.Read(buffer.data() + end, wanted);
+    if (got == 0) {
+      return false;
+    }
+    end += got;
+  }
+  return true;
+}
+
+template <ByteSource Source>
+bool ReadBuffer<Source>::readExactly(void *bytes, size_t size) {
+  char *dst = static_cast<char *>(bytes);
+  size_t got = 0;
+  while (got < size) {
+    size_t chunk = source.Read(dst + got, size - got);
+    if (chunk == 0) {
+      return false;
+    }
+    got += chunk;
+  }
+  return true;
+}
+
+template <ByteSource Source>
+void ReadBuffer<Source>::BeginCompressedBlocks() {
+  // Blocks are read past the buffer, which must not hold read-ahead bytes.
+  static_assert(!Source::kReadAhead, "compressed streams need exact reads");
+  if (!readExactly(&blockSize, sizeof(blockSize))) {
+    throw std::runtime_error("Error reading compression header...stopped");
+  }
+  compress = true;
+}
+
+template <ByteSource Source> void ReadBuffer<Source>::EndCompressedBlocks() {
+  while (compress && inflateBlock()) {
+  }
+  compress = false;
+}
+
+// Appends the next block to the buffer, false at the terminator.
+template <ByteSource Source> bool ReadBuffer<Source>::inflateBlock() {
+  uint32_t head[2] = {};
+  if (!readExactly(&head[0], sizeof(head[0]))) {
+    throw std::runtime_error("Error reading compressed block...stopped");
+  }
+  if (head[0] == 0) {
+    compress = false;
+    return false;
+  }
+  if (!readExactly(&head[1], sizeof(head[1]))) {
+    throw std::runtime_error("Error reading compressed block...stopped");
+  }
+  if (head[0] > blockSize || head[1] > head[0] ||
+      head[0] > lzMaxInflatedSize(head[1])) {
+    throw std::runtime_error("Corrupt compressed block...stopped");
+  }
+  packed.resize(head[1]);
+  if (!readExactly(packed.data(), head[1])) {
+    throw std::runtime_error("Error reading compressed block...stopped");
+  }
+
+  if (buffer.size() - end < head[0]) {
+    buffer.resize(end + head[0]);
+  }
+  if (head[1] == head[0]) {
+    memcpy(buffer.data() + end, packed.data(), head[0]);
+  } else {
+    lzDecompress(packed.data(), head[1], buffer.data() + end, head[0]);
+  }
+  end += head[0];
+  return true;
+}
+
+class List {
+public:
+  List() = default;
+  // Moves take the nodes along; the source is left empty.
+  List(List &&other) noexcept;
+  List &operator=(List &&other) noexcept;
+  List(const List &) = delete;
+  List &operator=(const List &) = delete;
+
+  // Builds a list of the payloads in one node allocation. Strings are
+  // moved out of an rvalue container, or out of its elements when they are
+  // rvalues; views such as spans only refer to strings owned elsewhere, so
+  // those and anything else convertible to std::string_view are copied.
+  // randIndices is empty or holds one entry per node, as for SetRandBatch.
+  template <std::ranges::sized_range Range>
+  static List FromRange(Range &&payloads,
+                        std::span<const int32_t> randIndices = {});
+
+  void Serialize(FILE *file, // fopen need for this task
+                 const SerializeOptions &options = SerializeOptions());
+  // Single-threaded Serialize into any ByteSink, such as a MemorySink or a
+  // SpanSink over a writable mapping.
+  template <ByteSink Sink>
+  void Serialize(Sink &sink,
+                 const SerializeOptions &options = SerializeOptions());
+  // Encodes on the calling thread while an I/O thread writes the previous
+  // bufferSize block, and returns once all is encoded: the list may change
+  // from then on. The future is ready when the list is flushed and fsynced;
+  // leave file alone until then. Needs threads == 1.
+  std::future<void>
+  SerializeAsync(FILE *file,
+                 const SerializeOptions &options = SerializeOptions());
+  // The bytes Serialize would write, in a vector of exactly that size.
+  std::vector<std::byte>
+  SerializeToBuffer(const SerializeOptions &options = SerializeOptions());
+  void Deserialize(FILE *file,
+                   const DeserializeOptions &options = DeserializeOptions());
+  // Parse straight from a read-only mapping of the file, no fread copies.
+  void Deserialize(const std::string &path,
+                   const DeserializeOptions &options = DeserializeOptions());
+  void Deserialize(int fd,
+                   const DeserializeOptions &options = DeserializeOptions());
+  // Reads exactly the list from source and no further, so a pipe or socket
+  // can carry more after it. Lazy payloads are copied.
+  template <ByteSource Source>
+  void Deserialize(Source &source,
+                   const DeserializeOptions &options = DeserializeOptions());
+  // Parses bytes where they are. Lazy payloads view them, so the caller
+  // keeps them alive until Clear or MaterializePayloads.
+  void DeserializeFrom(std::span<const std::byte> bytes,
+                       const DeserializeOptions &options =
+                           DeserializeOptions());
+  // Streams the list and builds only the nodes keep accepts, in file order.
+  // Needs 4 bytes per node in the file on top of the kept nodes (12 with
+  // DroppedRand::Follow). Reads what NodeStream can.
+  void DeserializeFiltered(FILE *file, const NodeFilter &keep,
+                           DroppedRand dropped = DroppedRand::Null);
+  // Just the structure of the list in a file: element i is the index of
+  // node i's rand target, -1 for nullptr; prev and next are i - 1 and i + 1.
+  static std::vector<int32_t>
+  ReadRandIndices(const std::string &path,
+                  const DeserializeOptions &options = DeserializeOptions());
+
+  void AddNode(const std::string &data);
+  // Takes over data's buffer, no copy.
+  void AddNode(std::string &&data);
+  // One copy into the node, for payloads sitting in some other buffer.
+  void AddNode(std::string_view data);
+  void AddNode(const char *data);
+  // Payload built from args as by a std::string constructor, e.g.
+  // EmplaceNode(size, 'x') or EmplaceNode(first, last), then moved into
+  // the node: its only allocation is the string's own.
+  template <typename... Args> void EmplaceNode(Args &&...args);
+  void SetRand(int nodeIndex, int randIndex);
+  // Sets every node's rand at once: element i is node i's rand target,
+  // -1 (or any index outside the list) for nullptr, as ReadRandIndices
+  // returns them. The span must hold one index per node. The nodes are
+  // split over threads workers, 0 picks hardware_concurrency.
+  void SetRandBatch(std::span<const int32_t> randIndices,
+                    unsigned threads = 1);
+  // Node at position index, nullptr when out of range. O(1).
+  ListNode *GetNode(int index) const;
+  int GetCount() const { return count; }
+  void Clear();
+  // Copies lazily loaded payloads into the nodes and lets go of the file.
+  void MaterializePayloads();
+  void PrintList();
+  ~List();
+
+private:
+  // Share the format readers below.
+  friend class SerializedListReader;
+  friend class NodeStream;
+  friend class IndexedList;
+
+  static uint32_t readUint32(FILE *file);
+  static size_t remainingBytes(FILE *file);
+  static void readNode(FILE *file, ListNode &node, int32_t &outRandIndex,
+                       bool skipPayload);
+  static void skipBytes(FILE *file, uint64_t size);
+  static void readRandIndicesAt(int fd, off_t &position, uint64_t size,
+                                uint32_t newCount,
+                                std::vector<int32_t> &randIndices);
+  static void setupLinks(const std::vector<ListNode *> &nodes, size_t begin,
+                         size_t end);
+  static ColumnarHeader readColumnarHeader(ByteReader &in);
+  static ChunkTable readChunkTable(const ColumnarHeader &header,
+                                   ByteReader &in);
+  // Rejects option combinations the writers can't produce. Serialize only
+  // reads the nodes: their index fields are kept current as they are added.
+  void prepareSerialize(const SerializeOptions &options);
+  template <ByteSink Sink>
+  void serializeTo(Sink &sink, const SerializeOptions &options);
+  template <typename Sink> void serializeInterleaved(WriteBuffer<Sink> &out);
+  template <typename Sink>
+  void writeIndexFooter(WriteBuffer<Sink> &out, uint32_t stride);
+  template <typename Sink>
+  void serializeColumnar(WriteBuffer<Sink> &out,
+                         const SerializeOptions &options);
+  void serializeParallel(FILE *file, const SerializeOptions &options);
+  void serializeGathered(FILE *file, const SerializeOptions &options);
+  template <typename Sink>
+  static void writeColumnarPrefix(WriteBuffer<Sink> &out,
+                                  const ColumnarHeader &header,
+                                  const ChunkTable &table);
+  // Encoders for the nodes in [first, last), last == nullptr for the tail.
+  template <typename Sink>
+  static void writeInterleavedNodes(WriteBuffer<Sink> &out, ListNode *first,
+                                    ListNode *last);
+  // ids, indexed by node position, replaces the data sizes when not null.
+  template <typename Sink>
+  static void writeLengths(WriteBuffer<Sink> &out, ListNode *first,
+                           ListNode *last, uint32_t flags,
+                           const uint32_t *ids = nullptr);
+  template <typename Sink>
+  static void writeRands(WriteBuffer<Sink> &out, ListNode *first,
+                         ListNode *last, uint32_t flags);
+  template <typename Sink>
+  static void writeDictionary(WriteBuffer<Sink> &out,
+                              const std::vector<std::string_view> &entries,
+                              uint32_t flags);
+  template <typename Sink>
+  static void writeField(WriteBuffer<Sink> &out, uint32_t value,
+                         uint32_t flags, const char *errorMessage);
+  static size_t fieldSize(uint32_t value, uint32_t flags);
+  // Bytes node adds to each columnar section under the given flags.
+  static ChunkOffsets encodedSize(const ListNode *node, uint32_t flags);
+  static uint32_t randValue(const ListNode *node, uint32_t flags);
+  static int32_t randIndexFromValue(uint32_t value, size_t index,
+                                    uint32_t flags);
+  static void decodeColumnarFields(const ColumnarHeader &header,
+                                   const ChunkTable &table, const char *lengths,
+                                   const char *rands,
+                                   std::vector<uint32_t> &outLengths,
+                                   std::vector<int32_t> &outRands,
+                                   unsigned threads);
+  template <typename Sink>
+  static void writePayloads(WriteBuffer<Sink> &out, ListNode *first,
+                            ListNode *last);
+  // Entries point into [begin, end).
+  static std::vector<std::string_view>
+  readDictionary(const char *begin, const char *end, uint32_t flags);
+  void deserializeInterleaved(FILE *file, uint32_t newCount,
+                              bool skipPayloads);
+  void deserializeColumnar(FILE *file, const DeserializeOptions &options);
+  // owner keeps the parsed bytes alive for lazy payloads, null copies them.
+  void buildColumnar(const ColumnarHeader &header, ByteReader &in,
+                     const DeserializeOptions &options,
+                     const std::shared_ptr<const void> &owner);
+  // The list after first in in, decoded as it is read: a node, a buffer of
+  // payloads or the columnar field sections are held at a time, never the
+  // whole list. Lazy payloads are copied, as nothing keeps the bytes around.
+  template <ByteSource Source>
+  void deserializeBuffered(ReadBuffer<Source> &in, uint32_t first,
+                           const DeserializeOptions &options);
+  template <ByteSource Source>
+  static uint32_t readUint32(ReadBuffer<Source> &in);
+  void deserializeMemory(const char *begin, const char *end,
+                         const DeserializeOptions &options,
+                         const std::shared_ptr<const void> &owner);
+  void parseStream(const char *begin, const char *end,
+                   const DeserializeOptions &options,
+                   const std::shared_ptr<const void> &owner);
+  void linkBack(ListNode *node);
+  static void setupRandPointers(const std::vector<ListNode *> &nodes,
+                                std::span<const int32_t> randIndices,
+                                size_t begin, size_t end);
+
+  NodeArena arena;
+  ListNode *head = nullptr;
+  ListNode *tail = nullptr;
+  int count = 0;
+  // positions[i] is node i and node i's index is i, both kept by every path
+  // that appends nodes.
+  std::vector<ListNode *> positions;
+  // Storage behind ListNode::shared views, released by Clear.
+  std::vector<std::shared_ptr<const void>> sharedPayloads;
+};
+
+void List::AddNode(const std::string &data) {
+  ListNode *newNode = arena.Allocate();
+  newNode->data = data;
+  linkBack(newNode);
+}
+
+void List::AddNode(std::string &&data) {
+  ListNode *newNode = arena.Allocate();
+  newNode->data = std::move(data);
+  linkBack(newNode);
+}
+
+void List::AddNode(std::string_view data) {
+  ListNode *newNode = arena.Allocate();
+  newNode->data.assign(data);
+  linkBack(newNode);
+}
+
+void List::AddNode(const char *data) { AddNode(std::string_view(data)); }
+
+template <typename... Args> void List::EmplaceNode(Args &&...args) {
+  AddNode(std::string(std::forward<Args>(args)...));
+}
+
+void List::linkBack(ListNode *node) {
+  if (!head) {
+    head = node;
+    tail = node;
+  } else {
+    tail->next = node;
+    node->prev = tail;
+    tail = node;
+  }
+
+  node->index = static_cast<uint32_t>(count);
+  positions.push_back(node);
+  count++;
+}
+void List::Serialize(FILE *file, const SerializeOptions &options) {
+  if (!file) {
+    throw std::runtime_error("File not open for writing...stopped");
+  }
+
+  prepareSerialize(options);
+  if (options.threads == 1 && options.gatherThreshold > 0 &&
+      options.compressBlockSize == 0) {
+    serializeGathered(file, options);
+    return;
+  }
+  if (options.threads == 1) {
+    FileSink sink(file);
+    serializeTo(sink, options);
+    return;
+  }
+
+  serializeParallel(file, options);
+  if (options.indexStride > 0) {
+    FileSink sink(file);
+    WriteBuffer out(sink, options.bufferSize);
+    writeIndexFooter(out, options.indexStride);
+    out.Flush();
+  }
+}
+
+template <ByteSink Sink>
+void List::Serialize(Sink &sink, const SerializeOptions &options) {
+  if (options.threads != 1) {
+    throw std::runtime_error(
+        "Parallel Serialize needs a FILE* to pwrite into...stopped");
+  }
+  prepareSerialize(options);
+  serializeTo(sink, options);
+}
+
+std::future<void> List::SerializeAsync(FILE *file,
+                                       const SerializeOptions &options) {
+  if (!file) {
+    throw std::runtime_error("File not open for writing...stopped");
+  }
+  if (options.threads != 1) {
+    throw std::runtime_error(
+        "Asynchronous Serialize needs threads == 1...stopped");
+  }
+
+  prepareSerialize(options);
+  AsyncSink sink(FileSink(file), options.bufferSize);
+  serializeTo(sink, options);
+  return sink.Finish([file](FileSink &) {
+    // fsync fails with EINVAL on pipes and the like, which have no disk.
+    if (fflush(file) != 0 ||
+        (fsync(fileno(file)) != 0 && errno != EINVAL)) {
+      throw std::runtime_error("Error syncing file...stopped");
+    }
+  });
+}
+
+std::vector<std::byte>
+List::SerializeToBuffer(const SerializeOptions &options) {
+  std::vector<std::byte> bytes;
+  if (options.compressBlockSize > 0) {
+    // Block sizes are known only after compressing them, grow instead of
+    // compressing everything twice.
+    MemorySink sink(bytes);
+    Serialize(sink, options);
+    return bytes;
+  }
+
+  CountingSink counter;
+  Serialize(counter, options);
+  bytes.resize(counter.GetCount());
+  SpanSink sink(reinterpret_cast<char *>(bytes.data()), bytes.size());
+  Serialize(sink, options);
+  return bytes;
+}
+
+// Hands the descriptor under file to a gathering sink: at its position
+// through pwritev when it can seek, otherwise (pipes) through writev.
+void List::serializeGathered(FILE *file, const SerializeOptions &options) {
+  if (fflush(file) != 0) {
+    throw std::runtime_error("Error flushing file...stopped");
+  }
+  off_t base = ftello(file);
+  if (base < 0) {
+    FdSink sink(fileno(file));
+    serializeTo(sink, options);
+    return;
+  }
+
+  PwriteSink sink(fileno(file), base);
+  serializeTo(sink, options);
+  if (fseeko(file, sink.GetOffset(), SEEK_SET) != 0) {
+    throw std::runtime_error("Error seeking past written list...stopped");
+  }
+}
+
+void List::prepareSerialize(const SerializeOptions &options) {
+  if ((options.varint || options.randDelta || options.dictionary) &&
+      options.format != Format::Columnar) {
+    throw std::runtime_error(
+        "Field encodings need the columnar format...stopped");
+  }
+
+  if ((options.compressBlockSize > 0 || options.dictionary) &&
+      options.threads != 1) {
+    throw std::runtime_error(
+        "Compression and dictionary need single-threaded Serialize...stopped");
+  }
+
+  if (options.indexStride > 0 && (options.format != Format::Interleaved ||
+                                  options.compressBlockSize > 0)) {
+    throw std::runtime_error(
+        "Index footer needs an uncompressed interleaved list...stopped");
+  }
+}
+
+template <ByteSink Sink>
+void List::serializeTo(Sink &sink, const SerializeOptions &options) {
+  bool compress = options.compressBlockSize > 0;
+  WriteBuffer out(sink,
+                  compress ? options.compressBlockSize : options.bufferSize,
+                  options.gatherThreshold);
+  if (compress) {
+    out.BeginCompressedBlocks();
+  }
+  if (options.format == Format::Columnar) {
+    serializeColumnar(out, options);
+  } else {
+    serializeInterleaved(out);
+  }
+  if (compress) {
+    out.EndCompressedBlocks();
+  }
+  if (options.indexStride > 0) {
+    writeIndexFooter(out, options.indexStride);
+  }
+  out.Flush();
+}
+
+template <typename Sink>
+void List::writeIndexFooter(WriteBuffer<Sink> &out, uint32_t stride) {
+  std::vector<uint64_t> offsets;
+  offsets.reserve(count / stride + 1);
+  uint64_t offset = sizeof(uint32_t); // past the count
+  for (ListNode *node = head; node; node = node->next) {
+    if (node->index % stride == 0) {
+      offsets.push_back(offset);
+    }
+    offset += sizeof(uint32_t) + node->Payload().size() + sizeof(int32_t);
+  }
+
+  uint32_t trailer[3] = {stride, static_cast<uint32_t>(offsets.size()),
+                         kIndexMagic};
+  out.Write(offsets.data(), offsets.size() * sizeof(uint64_t),
+            "Error writing index...stopped");
+  out.Write(trailer, sizeof(trailer), "Error writing index...stopped");
+}
+
+template <typename Sink>
+void List::serializeInterleaved(WriteBuffer<Sink> &out) {
+  uint32_t ucount = static_cast<uint32_t>(count);
+  out.Write(&ucount, sizeof(ucount), "Error writing count...stopped");
+  writeInterleavedNodes(out, head, nullptr);
+}
+
+template <typename Sink>
+void List::writeInterleavedNodes(WriteBuffer<Sink> &out, ListNode *first,
+                                 ListNode *last) {
+  // Each node already knows its position, so rand pointers resolve without a
+  // pointer-to-index table.
+  for (ListNode *node = first; node != last; node = node->next) {
+    std::string_view data = node->Payload();
+    uint32_t dataSize = static_cast<uint32_t>(data.size());
+    out.Write(&dataSize, sizeof(dataSize), "Error writing data size...stopped");
+
+    if (dataSize > 0) {
+      out.Reference(data.data(), dataSize, "Error writing data...stopped");
+    }
+
+    int32_t randIndex = -1;
+    if (node->rand != nullptr) {
+      randIndex = static_cast<int32_t>(node->rand->index);
+    }
+    out.Write(&randIndex, sizeof(randIndex),
+              "Error writing rand index...stopped");
+  }
+}
+
+template <typename Sink>
+void List::serializeColumnar(WriteBuffer<Sink> &out,
+                             const SerializeOptions &options) {
+  ColumnarHeader header;
+  header.count = static_cast<uint32_t>(count);
+  if (options.varint) {
+    header.flags |= kColumnarVarint;
+  }
+  if (options.randDelta) {
+    header.flags |= kColumnarRandDelta;
+  }
+
+  // Ids in order of first appearance. Views stay valid: nodes don't change
+  // while Serialize runs.
+  std::vector<uint32_t> ids;
+  std::vector<std::string_view> entries;
+  if (options.dictionary) {
+    header.flags |= kColumnarDictionary;
+    ids.reserve(count);
+    std::unordered_map<std::string_view, uint32_t> idOf;
+    for (ListNode *node = head; node; node = node->next) {
+      auto [it, inserted] = idOf.try_emplace(
+          node->Payload(), static_cast<uint32_t>(entries.size()));
+      if (inserted) {
+        entries.push_back(it->first);
+      }
+      ids.push_back(it->second);
+    }
+  }
+
+  ChunkTable table;
+  table.chunkNodes = options.chunkNodes;
+  ChunkOffsets total;
+  for (ListNode *node = head; node; node = node->next) {
+    if (table.chunkNodes > 0 && node->index % table.chunkNodes == 0) {
+      table.chunks.push_back(total);
+    }
+    ChunkOffsets size = encodedSize(node, header.flags);
+    if (options.dictionary) {
+      size.lengths = fieldSize(ids[node->index], header.flags);
+    }
+    total.lengths += size.lengths;
+    total.rands += size.rands;
+    total.payload += size.payload;
+  }
+  if (options.dictionary) {
+    total.payload = sizeof(uint32_t);
+    for (std::string_view entry : entries) {
+      total.payload +=
+          fieldSize(static_cast<uint32_t>(entry.size()), header.flags) +
+          entry.size();
+    }
+    for (ChunkOffsets &chunk : table.chunks) {
+      chunk.payload = 0;
+    }
+  }
+  if (table.chunkNodes > 0) {
+    header.flags |= kColumnarChunkTable;
+  }
+  header.lengthsSize = total.lengths;
+  header.randsSize = total.rands;
+  header.payloadSize = total.payload;
+
+  writeColumnarPrefix(out, header, table);
+  if (options.dictionary) {
+    writeLengths(out, head, nullptr, header.flags, ids.data());
+    writeRands(out, head, nullptr, header.flags);
+    writeDictionary(out, entries, header.flags);
+  } else {
+    writeLengths(out, head, nullptr, header.flags);
+    writeRands(out, head, nullptr, header.flags);
+    writePayloads(out, head, nullptr);
+  }
+}
+
+ChunkOffsets List::encodedSize(const ListNode *node, uint32_t flags) {
+  ChunkOffsets size;
+  size.payload = node->Payload().size();
+  size.lengths = fieldSize(static_cast<uint32_t>(size.payload), flags);
+  size.rands = fieldSize(randValue(node, flags), flags);
+  return size;
+}
+
+size_t List::fieldSize(uint32_t value, uint32_t flags) {
+  return flags & kColumnarVarint ? varintSize(value) : sizeof(uint32_t);
+}
+
+template <typename Sink>
+void List::writeField(WriteBuffer<Sink> &out, uint32_t value, uint32_t flags,
+                      const char *errorMessage) {
+  if (flags & kColumnarVarint) {
+    char varint[kMaxVarintSize];
+    out.Write(varint, encodeVarint(value, varint), errorMessage);
+  } else {
+    out.Write(&value, sizeof(value), errorMessage);
+  }
+}
+
+uint32_t List::randValue(const ListNode *node, uint32_t flags) {
+  if (flags & kColumnarRandDelta) {
+    if (!node->rand) {
+      return 0;
+    }
+    int64_t delta = int64_t{node->rand->index} - int64_t{node->index};
+    uint64_t zigzag =
+        delta < 0 ? (uint64_t(-delta) << 1) - 1 : uint64_t(delta) << 1;
+    return static_cast<uint32_t>(zigzag + 1);
+  }
+  if (flags & kColumnarVarint) {
+    return node->rand ? node->rand->index + 1 : 0;
+  }
+  return node->rand ? node->rand->index : static_cast<uint32_t>(-1);
+}
+
+int32_t List::randIndexFromValue(uint32_t value, size_t index,
+                                 uint32_t flags) {
+  if (flags & kColumnarRandDelta) {
+    if (value == 0) {
+      return -1;
+    }
+    uint32_t zigzag = value - 1;
+    int64_t delta =
+        (zigzag & 1) ? -int64_t{zigzag >> 1} - 1 : int64_t{zigzag >> 1};
+    int64_t randIndex = static_cast<int64_t>(index) + delta;
+    return randIndex >= 0 && randIndex <= INT32_MAX
+               ? static_cast<int32_t>(randIndex)
+               : -1;
+  }
+  if (flags & kColumnarVarint) {
+    return static_cast<int32_t>(value - 1);
+  }
+  return static_cast<int32_t>(value);
+}
+
+template <typename Sink>
+void List::writeColumnarPrefix(WriteBuffer<Sink> &out,
+                               const ColumnarHeader &header,
+                               const ChunkTable &table) {
+  out.Write(&header, sizeof(header), "Error writing header...stopped");
+
+  if (header.flags & kColumnarChunkTable) {
+    uint32_t chunkCount = static_cast<uint32_t>(table.chunks.size());
+    out.Write(&table.chunkNodes, sizeof(table.chunkNodes),
+              "Error writing chunk table...stopped");
+    out.Write(&chunkCount, sizeof(chunkCount),
+              "Error writing chunk table...stopped");
+    out.Write(table.chunks.data(), table.chunks.size() * sizeof(ChunkOffsets),
+              "Error writing chunk table...stopped");
+  }
+}
+
+template <typename Sink>
+void List::writeLengths(WriteBuffer<Sink> &out, ListNode *first, ListNode *last,
+                        uint32_t flags, const uint32_t *ids) {
+  for (ListNode *node = first; node != last; node = node->next) {
+    uint32_t value = ids ? ids[node->index]
+                         : static_cast<uint32_t>(node->Payload().size());
+    writeField(out, value, flags, "Error writing data size...stopped");
+  }
+}
+
+template <typename Sink>
+void List::writeRands(WriteBuffer<Sink> &out, ListNode *first, ListNode *last,
+                      uint32_t flags) {
+  for (ListNode *node = first; node != last; node = node->next) {
+    writeField(out, randValue(node, flags), flags,
+               "Error writing rand index...stopped");
+  }
+}
+
+template <typename Sink>
+void List::writePayloads(WriteBuffer<Sink> &out, ListNode *first,
+                         ListNode *last) {
+  for (ListNode *node = first; node != last; node = node->next) {
+    std::string_view data = node->Payload();
+    out.Reference(data.data(), data.size(), "Error writing data...stopped");
+  }
+}
+
+template <typename Sink>
+void List::writeDictionary(WriteBuffer<Sink> &out,
+                           const std::vector<std::string_view> &entries,
+                           uint32_t flags) {
+  uint32_t entryCount = static_cast<uint32_t>(entries.size());
+  out.Write(&entryCount, sizeof(entryCount),
+            "Error writing dictionary...stopped");
+  for (std::string_view entry : entries) {
+    writeField(out, static_cast<uint32_t>(entry.size()), flags,
+               "Error writing dictionary...stopped");
+  }
+  for (std::string_view entry : entries) {
+    out.Reference(entry.data(), entry.size(),
+                  "Error writing dictionary...stopped");
+  }
+}
+
+void List::serializeParallel(FILE *file, const SerializeOptions &options) {
+  off_t base = -1;
+  if (fflush(file) == 0) {
+    base = ftello(file);
+  }
+  if (base < 0) {
+    throw std::runtime_error("File not seekable for parallel write...stopped");
+  }
+  int fd = fileno(file);
+  // pwrite ignores the offset on an O_APPEND descriptor and appends every
+  // piece in completion order.
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || (flags & O_APPEND)) {
+    throw std::runtime_error("File opened for append...stopped");
+  }
+
+  const std::vector<ListNode *> &nodes = positions;
+  size_t n = nodes.size();
+
+  // Partitions are whole chunks, so they line up with the chunk table.
+  size_t chunkNodes = options.chunkNodes > 0 ? options.chunkNodes
+                                             : kDefaultChunkNodes;
+  size_t chunkCount = (n + chunkNodes - 1) / chunkNodes;
+  auto chunkEnd = [&](size_t c) { return std::min((c + 1) * chunkNodes, n); };
+  auto nodeAt = [&](size_t i) { return i < n ? nodes[i] : nullptr; };
+
+  bool columnar = options.format == Format::Columnar;
+  ColumnarHeader header;
+  header.count = static_cast<uint32_t>(n);
+  if (options.varint) {
+    header.flags |= kColumnarVarint;
+  }
+  if (options.randDelta) {
+    header.flags |= kColumnarRandDelta;
+  }
+
+  // offsets[c] ends up as the bytes before chunk c in each section.
+  std::vector<ChunkOffsets> offsets(chunkCount + 1);
+  parallelFor(chunkCount, options.threads, [&](size_t c0, size_t c1) {
+    for (size_t c = c0; c < c1; c++) {
+      ChunkOffsets bytes;
+      for (size_t i = c * chunkNodes; i < chunkEnd(c); i++) {
+        ChunkOffsets size = encodedSize(nodes[i], header.flags);
+        bytes.lengths += size.lengths;
+        bytes.rands += size.rands;
+        bytes.payload += size.payload;
+      }
+      offsets[c + 1] = bytes;
+    }
+  });
+  for (size_t c = 0; c < chunkCount; c++) {
+    offsets[c + 1].lengths += offsets[c].lengths;
+    offsets[c + 1].rands += offsets[c].rands;
+    offsets[c + 1].payload += offsets[c].payload;
+  }
+  header.lengthsSize = offsets[chunkCount].lengths;
+  header.randsSize = offsets[chunkCount].rands;
+  header.payloadSize = offsets[chunkCount].payload;
+
+  ChunkTable table;
+  off_t prefixSize = sizeof(uint32_t);
+  if (columnar) {
+    prefixSize = sizeof(ColumnarHeader);
+    if (options.chunkNodes > 0) {
+      header.flags |= kColumnarChunkTable;
+      table.chunkNodes = options.chunkNodes;
+      table.chunks.assign(offsets.begin(), offsets.end() - 1);
+      prefixSize += 2 * sizeof(uint32_t) + chunkCount * sizeof(ChunkOffsets);
+    }
+  }
+
+  {
+    PwriteSink sink(fd, base);
+    WriteBuffer out(sink, options.bufferSize);
+    if (columnar) {
+      writeColumnarPrefix(out, header, table);
+    } else {
+      uint32_t ucount = static_cast<uint32_t>(n);
+      out.Write(&ucount, sizeof(ucount), "Error writing count...stopped");
+    }
+    out.Flush();
+  }
+
+  off_t start = base + prefixSize;
+  parallelFor(chunkCount, options.threads, [&](size_t c0, size_t c1) {
+    size_t begin = c0 * chunkNodes;
+    ListNode *first = nodes[begin];
+    ListNode *last = nodeAt(c1 * chunkNodes);
+    const ChunkOffsets &at = offsets[c0];
+    if (!columnar) {
+      PwriteSink sink(fd, start + at.lengths + at.rands + at.payload);
+      WriteBuffer out(sink, options.bufferSize, options.gatherThreshold);
+      writeInterleavedNodes(out, first, last);
+      out.Flush();
+      return;
+    }
+
+    PwriteSink lengthsSink(fd, start + at.lengths);
+    WriteBuffer lengths(lengthsSink, options.bufferSize);
+    writeLengths(lengths, first, last, header.flags);
+    lengths.Flush();
+
+    PwriteSink randsSink(fd, start + header.lengthsSize + at.rands);
+    WriteBuffer rands(randsSink, options.bufferSize);
+    writeRands(rands, first, last, header.flags);
+    rands.Flush();
+
+    PwriteSink payloadsSink(
+        fd, start + header.lengthsSize + header.randsSize + at.payload);
+    WriteBuffer payloads(payloadsSink, options.bufferSize,
+                         options.gatherThreshold);
+    writePayloads(payloads, first, last);
+    payloads.Flush();
+  });
+
+  off_t end = start + static_cast<off_t>(header.lengthsSize +
+                                         header.randsSize + header.payloadSize);
+  if (fseeko(file, end, SEEK_SET) != 0) {
+    throw std::runtime_error("Error seeking past written list...stopped");
+  }
+}
+
+uint32_t List::readUint32(FILE *file) {
+  uint32_t value = 0;
+  if (fread(&value, sizeof(value), 1, file) != 1) {
+    throw std::runtime_error("Error reading uint32_t value...stopped");
+  }
+  return value;
+}
+
+void List::readNode(FILE *file, ListNode &node, int32_t &outRandIndex,
+                    bool skipPayload) {
+  uint32_t dataSize = readUint32(file);
+
+  if (skipPayload) {
+    skipBytes(file, dataSize);
+  } else if (dataSize > 0) {
+    std::string str;
+    str.resize(dataSize);
+    if (fread(&str[0], 1, dataSize, file) != dataSize) {
+      throw std::runtime_error("Error reading node data...stopped");
+    }
+    node.data = std::move(str);
+  }
+
+  if (fread(&outRandIndex, sizeof(outRandIndex), 1, file) != 1) {
+    throw std::runtime_error("Error reading rand index...stopped");
+  }
+}
+
+void List::skipBytes(FILE *file, uint64_t size) {
+  if (size == 0 || fseeko(file, static_cast<off_t>(size), SEEK_CUR) == 0) {
+    return;
+  }
+  // Not seekable (a pipe): read and drop.
+  char scratch[4096];
+  while (size > 0) {
+    size_t chunk = std::min<uint64_t>(size, sizeof(scratch));
+    if (fread(scratch, 1, chunk, file) != chunk) {
+      throw std::runtime_error("Error reading node data...stopped");
+    }
+    size -= chunk;
+  }
+}
+
+void List::setupLinks(const std::vector<ListNode *> &nodes, size_t begin,
+                      size_t end) {
+  size_t n = nodes.size();
+  for (size_t i = begin; i < end; i++) {
+    nodes[i]->index = static_cast<uint32_t>(i);
+    if (i > 0) {
+      nodes[i]->prev = nodes[i - 1];
+    } else {
+      nodes[i]->prev = nullptr;
+    }
+
+    if (i < n - 1) {
+      nodes[i]->next = nodes[i + 1];
+    } else {
+      nodes[i]->next = nullptr;
+    }
+  }
+}
+
+void List::setupRandPointers(const std::vector<ListNode *> &nodes,
+                             std::span<const int32_t> randIndices,
+                             size_t begin, size_t end) {
+  size_t n = nodes.size();
+  for (size_t i = begin; i < end; i++) {
+    int32_t randomIndex = randIndices[i];
+    if (randomIndex >= 0 && static_cast<size_t>(randomIndex) < n) {
+      nodes[i]->rand = nodes[randomIndex];
+    } else {
+      nodes[i]->rand = nullptr;
+    }
+  }
+}
+
+void List::Deserialize(FILE *file, const DeserializeOptions &options) {
+  Clear();
+
+  if (!file) {
+    throw std::runtime_error("File not open for reading...stopped");
+  }
+
+  uint32_t first = readUint32(file);
+  if (first == kCompressedMagic) {
+    // Block by block: ReadBuffer reads exactly what is asked, so the file is
+    // left just past the container.
+    FileSource source(file);
+    ReadBuffer<FileSource> in(source, kDefaultWriteBufferSize);
+    in.BeginCompressedBlocks();
+    deserializeBuffered(in, readUint32(in), options);
+    in.EndCompressedBlocks();
+  } else if (first == kColumnarMagic) {
+    deserializeColumnar(file, options);
+  } else {
+    deserializeInterleaved(file, first,
+                           options.payloads == PayloadMode::Skip);
+  }
+}
+
+void List::deserializeInterleaved(FILE *file, uint32_t newCount,
+                                  bool skipPayloads) {
+  std::vector<ListNode *> rawNodes;
+  rawNodes.reserve(newCount);
+  std::vector<int32_t> randIndices;
+  randIndices.reserve(newCount);
+
+  // One block for the whole list, unless the file is too short to hold
+  // newCount nodes of at least 8 bytes each.
+  size_t remaining = remainingBytes(file);
+  arena.Reserve(std::min<size_t>(newCount, remaining / 8));
+
+  try {
+    // Skipping through stdio still pulls every payload page into its
+    // buffer, so regular files go around it.
+    off_t position =
+        skipPayloads && remaining != SIZE_MAX ? ftello(file) : off_t{-1};
+    if (position >= 0) {
+      readRandIndicesAt(fileno(file), position, remaining, newCount,
+                        randIndices);
+      if (fseeko(file, position, SEEK_SET) != 0) {
+        throw std::runtime_error("Error seeking past the list...stopped");
+      }
+      for (size_t i = 0; i < newCount; i++) {
+        rawNodes.push_back(arena.Allocate());
+      }
+    }
+    for (size_t i = rawNodes.size(); i < newCount; i++) {
+      int32_t randomIndex = -1;
+      ListNode *node = arena.Allocate();
+      readNode(file, *node, randomIndex, skipPayloads);
+      rawNodes.push_back(node);
+      randIndices.push_back(randomIndex);
+    }
+  } catch (...) {
+    arena.Release();
+    throw;
+  }
+
+  setupLinks(rawNodes, 0, rawNodes.size());
+  setupRandPointers(rawNodes, randIndices, 0, rawNodes.size());
+
+  if (newCount > 0) {
+    head = rawNodes[0];
+    tail = rawNodes[newCount - 1];
+  } else {
+    head = tail = nullptr;
+  }
+  count = static_cast<int>(newCount);
+  positions = std::move(rawNodes);
+}
+
+// Rand indices of the newCount nodes in the size bytes from position on,
+// which is left just past the last node. Small payloads are read through a
+// large buffer; big ones are stepped over with one pread per node that picks
+// up its rand index together with the next node's size.
+void List::readRandIndicesAt(int fd, off_t &position, uint64_t size,
+                             uint32_t newCount,
+                             std::vector<int32_t> &randIndices) {
+  if (newCount > 0 && size / newCount < kSkipSeekMinPayload) {
+    PreadSource source(fd, position, size);
+    ReadBuffer<PreadSource> in(source, kSkipReadBufferSize);
+    for (size_t i = 0; i < newCount; i++) {
+      uint32_t dataSize = 0;
+      const char *field =
+          in.Read(sizeof(dataSize), "Error reading uint32_t value...stopped");
+      memcpy(&dataSize, field, sizeof(dataSize));
+      in.Skip(dataSize, "Error reading node data...stopped");
+      int32_t randIndex = -1;
+      memcpy(&randIndex,
+             in.Read(sizeof(randIndex), "Error reading rand index...stopped"),
+             sizeof(randIndex));
+      randIndices.push_back(randIndex);
+      position += static_cast<off_t>(sizeof(dataSize) + dataSize +
+                                     sizeof(randIndex));
+    }
+    return;
+  }
+
+  auto readAt = [&](void *bytes, size_t length, const char *errorMessage) {
+    PreadSource source(fd, position, length);
+    if (source.Read(static_cast<char *>(bytes), length) != length) {
+      throw std::runtime_error(errorMessage);
+    }
+    position += static_cast<off_t>(length);
+  };
+
+  uint32_t fields[2] = {}; // rand index, size of the next node
+  if (newCount > 0) {
+    readAt(&fields[1], sizeof(uint32_t),
+           "Error reading uint32_t value...stopped");
+  }
+  for (size_t i = 0; i < newCount; i++) {
+    position += static_cast<off_t>(fields[1]);
+    readAt(fields, i + 1 < newCount ? sizeof(fields) : sizeof(int32_t),
+           "Error reading rand index...stopped");
+    randIndices.push_back(static_cast<int32_t>(fields[0]));
+  }
+}
+
+size_t List::remainingBytes(FILE *file) {
+  struct stat info;
+  long position = ftell(file);
+  if (position < 0 || fstat(fileno(file), &info) != 0 ||
+      !S_ISREG(info.st_mode)) {
+    return SIZE_MAX; // pipe or socket, size unknown
+  }
+  return info.st_size > position ? static_cast<size_t>(info.st_size - position)
+                                 : 0;
+}
+
+ColumnarHeader List::readColumnarHeader(ByteReader &in) {
+  ColumnarHeader header;
+  header.version = in.ReadUint32();
+  header.count = in.ReadUint32();
+  header.flags = in.ReadUint32();
+  header.lengthsSize = in.ReadUint64();
+  header.randsSize = in.ReadUint64();
+  header.payloadSize = in.ReadUint64();
+
+  if (header.version != kColumnarVersion ||
+      (header.flags & ~kColumnarKnownFlags) != 0) {
+    throw std::runtime_error("Unsupported columnar format...stopped");
+  }
+  uint64_t minField = sizeof(uint32_t);
+  uint64_t maxField = sizeof(uint32_t);
+  if (header.flags & kColumnarVarint) {
+    minField = 1;
+    maxField = kMaxVarintSize;
+  }
+  for (uint64_t size : {header.lengthsSize, header.randsSize}) {
+    if (size < header.count * minField || size > header.count * maxField) {
+      throw std::runtime_error("Corrupt columnar header...stopped");
+    }
+  }
+  return header;
+}
+
+ChunkTable List::readChunkTable(const ColumnarHeader &header,
+                                ByteReader &in) {
+  ChunkTable table;
+  table.chunkNodes = in.ReadUint32();
+  uint32_t chunkCount = in.ReadUint32();
+  if (table.chunkNodes == 0 ||
+      chunkCount != (uint64_t{header.count} + table.chunkNodes - 1) /
+                        table.chunkNodes) {
+    throw std::runtime_error("Corrupt chunk table...stopped");
+  }
+
+  table.chunks.resize(chunkCount);
+  std::copy_n(in.ReadBytes(chunkCount * sizeof(ChunkOffsets),
+                           "Error reading chunk table...stopped"),
+              chunkCount * sizeof(ChunkOffsets),
+              reinterpret_cast<char *>(table.chunks.data()));
+
+  // Offsets only have to stay inside their sections here; decoding checks
+  // that every chunk ends exactly where the next one starts.
+  bool varint = header.flags & kColumnarVarint;
+  for (uint32_t c = 0; c < chunkCount; c++) {
+    uint64_t first = uint64_t{c} * table.chunkNodes;
+    const ChunkOffsets &chunk = table.chunks[c];
+    bool fixedMismatch =
+        !varint && (chunk.lengths != first * sizeof(uint32_t) ||
+                    chunk.rands != first * sizeof(int32_t));
+    if (fixedMismatch || chunk.lengths > header.lengthsSize ||
+        chunk.rands > header.randsSize || chunk.payload > header.payloadSize) {
+      throw std::runtime_error("Corrupt chunk table...stopped");
+    }
+  }
+  return table;
+}
+
+void List::deserializeColumnar(FILE *file, const DeserializeOptions &options) {
+  char raw[sizeof(ColumnarHeader) - sizeof(uint32_t)];
+  if (fread(raw, sizeof(raw), 1, file) != 1) {
+    throw std::runtime_error("Error reading header...stopped");
+  }
+  ByteReader headerReader(raw, raw + sizeof(raw));
+  ColumnarHeader header = readColumnarHeader(headerReader);
+
+  // The chunk table size follows from its first two words. After those, the
+  // rest of the table and all three sections come in with a single read.
+  auto buffer = std::make_shared<std::vector<char>>();
+  std::vector<char> &body = *buffer;
+  if (header.flags & kColumnarChunkTable) {
+    uint32_t chunkHead[2];
+    if (fread(chunkHead, sizeof(chunkHead), 1, file) != 1) {
+      throw std::runtime_error("Error reading chunk table...stopped");
+    }
+    if (chunkHead[1] > uint64_t{header.count} + 1) {
+      throw std::runtime_error("Corrupt chunk table...stopped");
+    }
+    body.resize(sizeof(chunkHead) + chunkHead[1] * sizeof(ChunkOffsets));
+    memcpy(body.data(), chunkHead, sizeof(chunkHead));
+  }
+  size_t alreadyRead = std::min(body.size(), 2 * sizeof(uint32_t));
+  uint64_t tableRest = body.size() - alreadyRead;
+
+  size_t remaining = remainingBytes(file);
+  if (header.payloadSize > remaining ||
+      header.lengthsSize + header.randsSize + tableRest >
+          remaining - header.payloadSize) {
+    throw std::runtime_error("Error reading columnar sections...stopped");
+  }
+  bool skip = options.payloads == PayloadMode::Skip;
+  size_t toRead = tableRest + header.lengthsSize + header.randsSize +
+                  (skip ? 0 : header.payloadSize);
+  body.resize(alreadyRead + toRead);
+  if (fread(body.data() + alreadyRead, 1, toRead, file) != toRead) {
+    throw std::runtime_error("Error reading columnar sections...stopped");
+  }
+  if (skip) {
+    skipBytes(file, header.payloadSize);
+  }
+
+  ByteReader in(body.data(), body.data() + body.size());
+  bool lazy = options.payloads == PayloadMode::Lazy;
+  buildColumnar(header, in, options, lazy ? buffer : nullptr);
+}
+
+void List::buildColumnar(const ColumnarHeader &header, ByteReader &in,
+                         const DeserializeOptions &options,
+                         const std::shared_ptr<const void> &owner) {
+  if (owner) {
+    sharedPayloads.push_back(owner);
+  }
+  ChunkTable table;
+  if (header.flags & kColumnarChunkTable) {
+    table = readChunkTable(header, in);
+  }
+  const char *lengths = in.ReadBytes(header.lengthsSize,
+                                     "Error reading data sizes...stopped");
+  const char *rands = in.ReadBytes(header.randsSize,
+                                   "Error reading rand indices...stopped");
+  bool skip = options.payloads == PayloadMode::Skip;
+  const char *payload =
+      skip ? nullptr
+           : in.ReadBytes(header.payloadSize,
+                          "Error reading node data...stopped");
+
+  std::vector<uint32_t> decodedLengths;
+  std::vector<int32_t> randIndices(header.count);
+  decodeColumnarFields(header, table, lengths, rands, decodedLengths,
+                       randIndices, options.threads);
+  if (header.flags & kColumnarVarint) {
+    lengths = reinterpret_cast<const char *>(decodedLengths.data());
+  }
+
+  // In dictionary mode lengths holds ids. Lazy nodes share the entries,
+  // the others copy theirs.
+  bool dictionary = header.flags & kColumnarDictionary;
+  std::vector<std::string_view> entries;
+  if (dictionary && !skip) {
+    entries =
+        readDictionary(payload, payload + header.payloadSize, header.flags);
+  }
+
+  // Without a stored table the chunk starts are one running sum away.
+  if (table.chunks.empty()) {
+    table.chunkNodes = kDefaultChunkNodes;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < header.count; i++) {
+      uint32_t dataSize = 0;
+      memcpy(&dataSize, lengths + i * sizeof(uint32_t), sizeof(dataSize));
+      if (i % table.chunkNodes == 0) {
+        table.chunks.push_back(
+            ChunkOffsets{i * sizeof(uint32_t), i * sizeof(int32_t), offset});
+      }
+      offset += dictionary ? 0 : dataSize;
+    }
+  }
+
+  ListNode *block = arena.AllocateBlock(header.count);
+  std::vector<ListNode *> nodes(header.count);
+  size_t n = nodes.size();
+  size_t chunkNodes = table.chunkNodes;
+  size_t chunkCount = table.chunks.size();
+
+  try {
+    parallelFor(chunkCount, options.threads,
+                [&](size_t firstChunk, size_t lastChunk) {
+                  size_t end = std::min(lastChunk * chunkNodes, n);
+                  for (size_t i = firstChunk * chunkNodes; i < end; i++) {
+                    nodes[i] = block + i;
+                  }
+                });
+
+    // Each chunk decodes its payloads from its own offset, so chunks are
+    // independent; a chunk must end exactly where the next one starts.
+    parallelFor(chunkCount, options.threads, [&](size_t firstChunk,
+                                                 size_t lastChunk) {
+      for (size_t c = firstChunk; c < lastChunk && dictionary && !skip;
+           c++) {
+        size_t end = std::min((c + 1) * chunkNodes, n);
+        for (size_t i = c * chunkNodes; i < end; i++) {
+          uint32_t id = 0;
+          memcpy(&id, lengths + i * sizeof(uint32_t), sizeof(id));
+          if (id >= entries.size()) {
+            throw std::runtime_error("Corrupt dictionary id...stopped");
+          }
+          if (owner) {
+            block[i].shared = entries[id];
+          } else {
+            block[i].data.assign(entries[id]);
+          }
+        }
+      }
+      for (size_t c = firstChunk; c < lastChunk && !dictionary && !skip;
+           c++) {
+        uint64_t offset = table.chunks[c].payload;
+        uint64_t chunkEnd = c + 1 < chunkCount ? table.chunks[c + 1].payload
+                                               : header.payloadSize;
+        size_t end = std::min((c + 1) * chunkNodes, n);
+        for (size_t i = c * chunkNodes; i < end; i++) {
+          uint32_t dataSize = 0;
+          memcpy(&dataSize, lengths + i * sizeof(uint32_t), sizeof(dataSize));
+          if (offset > chunkEnd || dataSize > chunkEnd - offset) {
+            throw std::runtime_error("Error reading node data...stopped");
+          }
+          if (owner) {
+            block[i].shared = std::string_view(payload + offset, dataSize);
+          } else {
+            block[i].data.assign(payload + offset, dataSize);
+          }
+          offset += dataSize;
+        }
+        if (offset != chunkEnd) {
+          throw std::runtime_error("Corrupt chunk table...stopped");
+        }
+      }
+
+      size_t begin = firstChunk * chunkNodes;
+      size_t end = std::min(lastChunk * chunkNodes, n);
+      setupLinks(nodes, begin, end);
+      setupRandPointers(nodes, randIndices, begin, end);
+    });
+  } catch (...) {
+    Clear();
+    throw;
+  }
+
+  if (n > 0) {
+    head = nodes[0];
+    tail = nodes[n - 1];
+  }
+  count = static_cast<int>(n);
+  positions = std::move(nodes);
+}
+
+void List::decodeColumnarFields(const ColumnarHeader &header,
+                                const ChunkTable &table, const char *lengths,
+                                const char *rands,
+                                std::vector<uint32_t> &outLengths,
+                                std::vector<int32_t> &outRands,
+                                unsigned threads) {
+  uint32_t flags = header.flags;
+  if (!(flags & (kColumnarVarint | kColumnarRandDelta))) {
+    // Stored as is. copy_n, as memcpy rejects the null data() of an empty
+    // list even for zero bytes.
+    std::copy_n(rands, header.randsSize,
+                reinterpret_cast<char *>(outRands.data()));
+    return;
+  }
+
+  // Rand values land in outRands as raw uint32 first and are then turned
+  // back into absolute indices in place.
+  bool varint = flags & kColumnarVarint;
+  if (varint) {
+    outLengths.resize(header.count);
+  }
+  uint32_t *rawRands = reinterpret_cast<uint32_t *>(outRands.data());
+  auto decodeRange = [&](size_t begin, size_t end, const ChunkOffsets &from,
+                         const ChunkOffsets &to) {
+    if (from.lengths > to.lengths || from.rands > to.rands) {
+      throw std::runtime_error("Corrupt chunk table...stopped");
+    }
+    if (!varint) {
+      std::copy_n(rands + from.rands, (end - begin) * sizeof(uint32_t),
+                  reinterpret_cast<char *>(rawRands + begin));
+    } else if (decodeVarints(lengths + from.lengths, lengths + to.lengths,
+                             outLengths.data() + begin,
+                             end - begin) != lengths + to.lengths ||
+               decodeVarints(rands + from.rands, rands + to.rands,
+                             rawRands + begin,
+                             end - begin) != rands + to.rands) {
+      throw std::runtime_error("Error reading varint...stopped");
+    }
+    for (size_t i = begin; i < end; i++) {
+      outRands[i] = randIndexFromValue(rawRands[i], i, flags);
+    }
+  };
+
+  ChunkOffsets sectionEnd{header.lengthsSize, header.randsSize,
+                          header.payloadSize};
+  if (table.chunks.empty()) {
+    decodeRange(0, header.count, ChunkOffsets(), sectionEnd);
+    return;
+  }
+
+  size_t chunkNodes = table.chunkNodes;
+  size_t chunkCount = table.chunks.size();
+  parallelFor(chunkCount, threads, [&](size_t c0, size_t c1) {
+    for (size_t c = c0; c < c1; c++) {
+      const ChunkOffsets &to =
+          c + 1 < chunkCount ? table.chunks[c + 1] : sectionEnd;
+      decodeRange(c * chunkNodes,
+                  std::min<size_t>((c + 1) * chunkNodes, header.count),
+                  table.chunks[c], to);
+    }
+  });
+}
+
+std::vector<std::string_view>
+List::readDictionary(const char *begin, const char *end, uint32_t flags) {
+  ByteReader in(begin, end);
+  uint32_t entryCount = in.ReadUint32();
+  if (entryCount > in.Remaining()) { // every entry has a length field
+    throw std::runtime_error("Corrupt dictionary...stopped");
+  }
+
+  std::vector<uint32_t> sizes(entryCount);
+  const char *pos = end - in.Remaining();
+  if (flags & kColumnarVarint) {
+    pos = decodeVarints(pos, end, sizes.data(), entryCount);
+  } else {
+    size_t bytes = entryCount * sizeof(uint32_t);
+    std::copy_n(in.ReadBytes(bytes, "Corrupt dictionary...stopped"), bytes,
+                reinterpret_cast<char *>(sizes.data()));
+    pos += bytes;
+  }
+
+  std::string_view bytes(pos, static_cast<size_t>(end - pos));
+  std::vector<std::string_view> entries(entryCount);
+  size_t offset = 0;
+  for (uint32_t e = 0; e < entryCount; e++) {
+    if (sizes[e] > bytes.size() - offset) {
+      throw std::runtime_error("Corrupt dictionary...stopped");
+    }
+    entries[e] = bytes.substr(offset, sizes[e]);
+    offset += sizes[e];
+  }
+  if (offset != bytes.size()) {
+    throw std::runtime_error("Corrupt dictionary...stopped");
+  }
+  return entries;
+}
+
+void List::Deserialize(const std::string &path,
+                       const DeserializeOptions &options) {
+  Clear();
+  auto mapped = std::make_shared<const MappedFile>(path);
+  bool lazy = options.payloads == PayloadMode::Lazy;
+  deserializeMemory(mapped->Data(), mapped->Data() + mapped->Size(), options,
+                    lazy ? mapped : nullptr);
+}
+
+void List::Deserialize(int fd, const DeserializeOptions &options) {
+  Clear();
+  auto mapped = std::make_shared<const MappedFile>(fd);
+  bool lazy = options.payloads == PayloadMode::Lazy;
+  deserializeMemory(mapped->Data(), mapped->Data() + mapped->Size(), options,
+                    lazy ? mapped : nullptr);
+}
+
+template <ByteSource Source>
+void List::Deserialize(Source &source, const DeserializeOptions &options) {
+  Clear();
+  ExactSource<Source> exact(source);
+  ReadBuffer<ExactSource<Source>> in(exact, kDefaultWriteBufferSize);
+  uint32_t first = readUint32(in);
+  if (first == kCompressedMagic) {
+    in.BeginCompressedBlocks();
+    deserializeBuffered(in, readUint32(in), options);
+    in.EndCompressedBlocks();
+  } else {
+    deserializeBuffered(in, first, options);
+  }
+}
+
+void List::DeserializeFrom(std::span<const std::byte> bytes,
+                           const DeserializeOptions &options) {
+  Clear();
+  const char *begin = reinterpret_cast<const char *>(bytes.data());
+  // Non-owning: points at the caller's bytes without keeping them alive.
+  std::shared_ptr<const void> view(std::shared_ptr<const void>(), begin);
+  bool lazy = options.payloads == PayloadMode::Lazy;
+  deserializeMemory(begin, begin + bytes.size(), options,
+                    lazy ? view : nullptr);
+}
+
+std::vector<int32_t> List::ReadRandIndices(const std::string &path,
+                                           const DeserializeOptions &options) {
+  MappedFile mapped(path);
+  const char *begin = mapped.Data();
+  const char *end = begin + mapped.Size();
+  std::vector<char> stream;
+  ByteReader probe(begin, end);
+  if (probe.Remaining() >= sizeof(uint32_t) &&
+      probe.ReadUint32() == kCompressedMagic) {
+    stream = inflateBlocks(probe, options.threads);
+    begin = stream.data();
+    end = begin + stream.size();
+  }
+
+  ByteReader in(begin, end);
+  uint32_t newCount = in.ReadUint32();
+  std::vector<int32_t> randIndices;
+  if (newCount == kColumnarMagic) {
+    // The rand section alone; payload bytes are never touched.
+    ColumnarHeader header = readColumnarHeader(in);
+    ChunkTable table;
+    if (header.flags & kColumnarChunkTable) {
+      table = readChunkTable(header, in);
+    }
+    const char *lengths = in.ReadBytes(header.lengthsSize,
+                                       "Error reading data sizes...stopped");
+    const char *rands = in.ReadBytes(header.randsSize,
+                                     "Error reading rand indices...stopped");
+    std::vector<uint32_t> decodedLengths;
+    randIndices.resize(header.count);
+    decodeColumnarFields(header, table, lengths, rands, decodedLengths,
+                         randIndices, options.threads);
+  } else {
+    randIndices.reserve(std::min<size_t>(newCount, in.Remaining() / 8));
+    for (size_t i = 0; i < newCount; i++) {
+      uint32_t dataSize = in.ReadUint32();
+      in.ReadBytes(dataSize, "Error reading node data...stopped");
+      randIndices.push_back(in.ReadInt32("Error reading rand index...stopped"));
+    }
+  }
+
+  for (int32_t &randIndex : randIndices) {
+    if (randIndex < 0 || static_cast<size_t>(randIndex) >= randIndices.size()) {
+      randIndex = -1;
+    }
+  }
+  return randIndices;
+}
+
+void List::deserializeMemory(const char *begin, const char *end,
+                             const DeserializeOptions &options,
+                             const std::shared_ptr<const void> &owner) {
+  ByteReader in(begin, end);
+  if (in.Remaining() >= sizeof(uint32_t) &&
+      in.ReadUint32() == kCompressedMagic) {
+    // Lazy payloads then point into the decompressed copy instead.
+    auto stream = std::make_shared<const std::vector<char>>(
+        inflateBlocks(in, options.threads));
+    parseStream(stream->data(), stream->data() + stream->size(), options,
+                owner ? stream : nullptr);
+  } else {
+    parseStream(begin, end, options, owner);
+  }
+}
+
+// An uncompressed interleaved or columnar stream held in memory.
+void List::parseStream(const char *begin, const char *end,
+                       const DeserializeOptions &options,
+                       const std::shared_ptr<const void> &owner) {
+  ByteReader in(begin, end);
+  uint32_t newCount = in.ReadUint32();
+  if (newCount == kColumnarMagic) {
+    ColumnarHeader header = readColumnarHeader(in);
+    buildColumnar(header, in, options, owner);
+    return;
+  }
+  if (owner) {
+    sharedPayloads.push_back(owner);
+  }
+
+  // Every node takes at least 8 bytes, don't trust the header beyond that.
+  size_t expected = std::min<size_t>(newCount, in.Remaining() / 8);
+  positions.reserve(expected);
+  std::vector<int32_t> randIndices;
+  randIndices.reserve(expected);
+  arena.Reserve(expected);
+
+  try {
+    for (size_t i = 0; i < newCount; i++) {
+      uint32_t dataSize = in.ReadUint32();
+      const char *bytes =
+          in.ReadBytes(dataSize, "Error reading node data...stopped");
+      int32_t randomIndex = in.ReadInt32("Error reading rand index...stopped");
+
+      ListNode *node = arena.Allocate();
+      if (owner) {
+        node->shared = std::string_view(bytes, dataSize);
+      } else if (options.payloads != PayloadMode::Skip) {
+        node->data.assign(bytes, dataSize);
+      }
+      linkBack(node);
+      randIndices.push_back(randomIndex);
+    }
+  } catch (...) {
+    Clear();
+    throw;
+  }
+
+  setupRandPointers(positions, randIndices, 0, positions.size());
+}
+
+template <ByteSource Source>
+uint32_t List::readUint32(ReadBuffer<Source> &in) {
+  uint32_t value = 0;
+  const char *bytes =
+      in.Read(sizeof(value), "Error reading uint32_t value...stopped");
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+template <ByteSource Source>
+void List::deserializeBuffered(ReadBuffer<Source> &in, uint32_t first,
+                               const DeserializeOptions &options) {
+  bool skip = options.payloads == PayloadMode::Skip;
+  std::vector<ListNode *> nodes;
+  std::vector<int32_t> randIndices;
+
+  try {
+    if (first != kColumnarMagic) {
+      // Each read takes a node's payload and rand index together with the
+      // next node's size, so no read reaches past the list.
+      size_t newCount = first;
+      uint32_t dataSize = newCount > 0 ? readUint32(in) : 0;
+      for (size_t i = 0; i < newCount; i++) {
+        size_t tail = sizeof(int32_t) + (i + 1 < newCount ? sizeof(uint32_t)
+                                                          : 0);
+        ListNode *node = arena.Allocate();
+        const char *bytes = nullptr;
+        if (skip) {
+          in.Skip(dataSize, "Error reading node data...stopped");
+          bytes = in.Read(tail, "Error reading rand index...stopped");
+        } else {
+          bytes = in.Read(size_t{dataSize} + tail,
+                          "Error reading node data...stopped");
+          node->data.assign(bytes, dataSize);
+          bytes += dataSize;
+        }
+        linkBack(node);
+        nodes.push_back(node);
+        int32_t randIndex = -1;
+        memcpy(&randIndex, bytes, sizeof(randIndex));
+        randIndices.push_back(randIndex);
+        memcpy(&dataSize, bytes + sizeof(randIndex),
+               tail - sizeof(randIndex));
+      }
+      setupRandPointers(nodes, randIndices, 0, nodes.size());
+      return;
+    }
+
+    const char *raw = in.Read(sizeof(ColumnarHeader) - sizeof(uint32_t),
+                              "Error reading header...stopped");
+    ByteReader headerReader(raw,
+                            raw + sizeof(ColumnarHeader) - sizeof(uint32_t));
+    ColumnarHeader header = readColumnarHeader(headerReader);
+    ChunkTable table;
+    if (header.flags & kColumnarChunkTable) {
+      uint32_t shape[2] = {}; // chunkNodes, chunkCount
+      memcpy(shape,
+             in.Read(sizeof(shape), "Error reading chunk table...stopped"),
+             sizeof(shape));
+      if (shape[1] > uint64_t{header.count} + 1) {
+        throw std::runtime_error("Corrupt chunk table...stopped");
+      }
+      std::vector<char> bytes(sizeof(shape) +
+                              size_t{shape[1]} * sizeof(ChunkOffsets));
+      memcpy(bytes.data(), shape, sizeof(shape));
+      memcpy(bytes.data() + sizeof(shape),
+             in.Read(bytes.size() - sizeof(shape),
+                     "Error reading chunk table...stopped"),
+             bytes.size() - sizeof(shape));
+      ByteReader tableReader(bytes.data(), bytes.data() + bytes.size());
+      table = readChunkTable(header, tableReader);
+    }
+
+    // Both field sections in one piece, decoded before the payloads move
+    // the buffer.
+    const char *fields =
+        in.Read(header.lengthsSize + header.randsSize,
+                "Error reading data sizes...stopped");
+    std::vector<uint32_t> sizes;
+    randIndices.resize(header.count);
+    decodeColumnarFields(header, table, fields, fields + header.lengthsSize,
+                         sizes, randIndices, options.threads);
+    if (!(header.flags & kColumnarVarint)) {
+      sizes.resize(header.count);
+      std::copy_n(fields, header.lengthsSize,
+                  reinterpret_cast<char *>(sizes.data()));
+    }
+
+    ListNode *block = arena.AllocateBlock(header.count);
+    nodes.resize(header.count);
+    for (size_t i = 0; i < nodes.size(); i++) {
+      nodes[i] = block + i;
+    }
+    if (skip) {
+      in.Skip(header.payloadSize, "Error reading node data...stopped");
+    } else if (header.flags & kColumnarDictionary) {
+      // sizes holds dictionary ids.
+      const char *bytes = in.Read(header.payloadSize,
+                                  "Error reading dictionary...stopped");
+      std::vector<std::string_view> entries =
+          readDictionary(bytes, bytes + header.payloadSize, header.flags);
+      for (size_t i = 0; i < nodes.size(); i++) {
+        if (sizes[i] >= entries.size()) {
+          throw std::runtime_error("Corrupt dictionary id...stopped");
+        }
+        block[i].data.assign(entries[sizes[i]]);
+      }
+    } else {
+      uint64_t total = std::accumulate(sizes.begin(), sizes.end(),
+                                       uint64_t{0});
+      if (total != header.payloadSize) {
+        throw std::runtime_error("Error reading node data...stopped");
+      }
+      // Payloads are fetched a buffer's worth of nodes at a time; the
+      // section size is known, so this never reads past it.
+      for (size_t i = 0; i < nodes.size();) {
+        size_t end = i;
+        size_t bytes = 0;
+        do {
+          bytes += sizes[end++];
+        } while (end < nodes.size() && bytes < kDefaultWriteBufferSize);
+        const char *payload =
+            in.Read(bytes, "Error reading node data...stopped");
+        for (; i < end; i++) {
+          block[i].data.assign(payload, sizes[i]);
+          payload += sizes[i];
+        }
+      }
+    }
+
+    setupLinks(nodes, 0, nodes.size());
+    setupRandPointers(nodes, randIndices, 0, nodes.size());
+    if (!nodes.empty()) {
+      head = nodes.front();
+      tail = nodes.back();
+    }
+    count = static_cast<int>(nodes.size());
+  } catch (...) {
+    Clear();
+    throw;
+  }
+}
+
+void List::SetRand(int nodeIndex, int randIndex) {
+  if (nodeIndex < 0 || nodeIndex >= count || randIndex < 0 ||
+      randIndex >= count) {
+    return;
+  }
+
+  positions[nodeIndex]->rand = positions[randIndex];
+}
+
+void List::SetRandBatch(std::span<const int32_t> randIndices,
+                        unsigned threads) {
+  if (randIndices.size() != positions.size()) {
+    throw std::runtime_error(
+        "Rand index count doesn't match the list...stopped");
+  }
+  parallelFor(positions.size(), threads, [&](size_t begin, size_t end) {
+    setupRandPointers(positions, randIndices, begin, end);
+  });
+}
+
+ListNode *List::GetNode(int index) const {
+  if (index < 0 || index >= count) {
+    return nullptr;
+  }
+  return positions[index];
+}
+
+void List::Clear() {
+  arena.Release();
+  positions = {};
+  sharedPayloads.clear();
+  head = nullptr;
+  tail = nullptr;
+  count = 0;
+}
+
+void List::MaterializePayloads() {
+  for (ListNode *node = head; node; node = node->next) {
+    if (node->shared.data()) {
+      node->data.assign(node->shared);
+      node->shared = std::string_view();
+    }
+  }
+  sharedPayloads.clear();
+}
+
+List::~List() { Clear(); }
+
+List::List(List &&other) noexcept
+    : arena(std::move(other.arena)), head(other.head), tail(other.tail),
+      count(other.count), positions(std::move(other.positions)),
+      sharedPayloads(std::move(other.sharedPayloads)) {
+  other.Clear();
+}
+
+List &List::operator=(List &&other) noexcept {
+  if (this != &other) {
+    Clear();
+    arena = std::move(other.arena);
+    head = other.head;
+    tail = other.tail;
+    count = other.count;
+    positions = std::move(other.positions);
+    sharedPayloads = std::move(other.sharedPayloads);
+    other.Clear();
+  }
+  return *this;
+}
+
+template <std::ranges::sized_range Range>
+List List::FromRange(Range &&payloads, std::span<const int32_t> randIndices) {
+  size_t n = std::ranges::size(payloads);
+  if (!randIndices.empty() && randIndices.size() != n) {
+    throw std::runtime_error(
+        "Rand index count doesn't match the list...stopped");
+  }
+
+  List list;
+  ListNode *block = list.arena.AllocateBlock(n);
+  list.positions.reserve(n);
+  size_t i = 0;
+  for (auto &&payload : payloads) {
+    using Element = decltype(payload);
+    constexpr bool movable =
+        std::is_same_v<std::remove_cvref_t<Element>, std::string> &&
+        !std::is_const_v<std::remove_reference_t<Element>> &&
+        (std::is_rvalue_reference_v<Element> ||
+         (!std::is_lvalue_reference_v<Range> &&
+          !std::ranges::view<std::remove_cvref_t<Range>>));
+    ListNode *node = block + i++;
+    if constexpr (movable) {
+      node->data = std::move(payload);
+    } else {
+      node->data.assign(std::string_view(payload));
+    }
+    list.linkBack(node);
+  }
+  if (!randIndices.empty()) {
+    list.SetRandBatch(randIndices);
+  }
+  return list;
+}
+
+void List::PrintList() {
+  ListNode *node = head;
+  uint32_t index = 0;
+  while (node) {
+    std::cout << "Node " << index << ": data = " << node->Payload()
+              << ", rand = ";
+    if (node->rand)
+      std::cout << node->rand->Payload();
+    else
+      std::cout << "nullptr";
+    std::cout << std::endl;
+    node = node->next;
+    ++index;
+  }
+}
+
+// A node as stored in a file: its payload and the index of its rand
+// target, -1 for nullptr.
+struct NodeRecord {
+  std::string_view data;
+  int32_t rand = -1;
+};
+
+// Looks up nodes of a serialized list without loading the whole list.
+// Interleaved files start from their index footer, or from an index built in
+// one pass when they have none; columnar files start from the chunk holding
+// the node. A lookup decodes at most one stride or chunk of nodes. Records
+// point into the mapped file and stay valid while the reader lives.
+class SerializedListReader {
+public:
+  explicit SerializedListReader(const std::string &path);
+
+  size_t GetCount() const { return count; }
+  NodeRecord Read(size_t index) const;
+  // Nodes [first, first + n), clipped to the end of the list.
+  std::vector<NodeRecord> ReadRange(size_t first, size_t n) const;
+
+private:
+  void openInterleaved(ByteReader &in);
+  void openColumnar(ByteReader &in);
+  uint32_t readField(const char *&pos, const char *end) const;
+
+  std::shared_ptr<const MappedFile> file;
+  size_t count = 0;
+  bool columnar = false;
+  // Interleaved: where every stride-th node starts, from the start of file.
+  uint32_t stride = 0;
+  std::vector<uint64_t> offsets;
+  const char *listEnd = nullptr;
+  // Columnar: the sections and where each chunk starts in them.
+  ColumnarHeader header;
+  ChunkTable table;
+  const char *lengths = nullptr;
+  const char *rands = nullptr;
+  const char *payload = nullptr;
+  std::vector<std::string_view> entries; // dictionary
+};
+
+SerializedListReader::SerializedListReader(const std::string &path)
+    : file(std::make_shared<const MappedFile>(path)) {
+  ByteReader in(file->Data(), file->Data() + file->Size());
+  uint32_t first = in.ReadUint32();
+  if (first == kCompressedMagic) {
+    throw std::runtime_error(
+        "Random access needs an uncompressed file...stopped");
+  }
+  if (first == kColumnarMagic) {
+    openColumnar(in);
+  } else {
+    count = first;
+    openInterleaved(in);
+  }
+}
+
+void SerializedListReader::openInterleaved(ByteReader &in) {
+  const char *begin = file->Data();
+  const char *end = begin + file->Size();
+  listEnd = end;
+
+  uint32_t trailer[3] = {};
+  if (in.Remaining() >= sizeof(trailer)) {
+    memcpy(trailer, end - sizeof(trailer), sizeof(trailer));
+  }
+  if (trailer[2] == kIndexMagic) {
+    stride = trailer[0];
+    uint64_t entryCount = trailer[1];
+    uint64_t footerSize = sizeof(trailer) + entryCount * sizeof(uint64_t);
+    if (stride == 0 || entryCount != (count + stride - 1) / stride ||
+        footerSize > in.Remaining()) {
+      throw std::runtime_error("Corrupt index...stopped");
+    }
+    listEnd = end - footerSize;
+    offsets.resize(entryCount);
+    std::copy_n(listEnd, entryCount * sizeof(uint64_t),
+                reinterpret_cast<char *>(offsets.data()));
+    for (uint64_t offset : offsets) {
+      if (offset > static_cast<uint64_t>(listEnd - begin)) {
+        throw std::runtime_error("Corrupt index...stopped");
+      }
+    }
+    return;
+  }
+
+  // No footer: one pass over the sizes builds the same index.
+  stride = kDefaultIndexStride;
+  offsets.reserve(count / stride + 1);
+  for (size_t i = 0; i < count; i++) {
+    if (i % stride == 0) {
+      offsets.push_back(static_cast<uint64_t>(end - in.Remaining() - begin));
+    }
+    uint32_t dataSize = in.ReadUint32();
+    in.ReadBytes(dataSize + sizeof(int32_t),
+                 "Error reading node data...stopped");
+  }
+}
+
+void SerializedListReader::openColumnar(ByteReader &in) {
+  columnar = true;
+  header = List::readColumnarHeader(in);
+  count = header.count;
+  if (header.flags & kColumnarChunkTable) {
+    table = List::readChunkTable(header, in);
+  }
+  lengths = in.ReadBytes(header.lengthsSize,
+                         "Error reading data sizes...stopped");
+  rands =
+      in.ReadBytes(header.randsSize, "Error reading rand indices...stopped");
+  payload =
+      in.ReadBytes(header.payloadSize, "Error reading node data...stopped");
+
+  bool dictionary = header.flags & kColumnarDictionary;
+  if (dictionary) {
+    entries = List::readDictionary(payload, payload + header.payloadSize,
+                                   header.flags);
+  }
+  if (!table.chunks.empty()) {
+    return;
+  }
+
+  // No stored table: build one in a single pass over both field sections.
+  table.chunkNodes = kDefaultIndexStride;
+  table.chunks.reserve(count / table.chunkNodes + 1);
+  const char *lengthPos = lengths;
+  const char *randPos = rands;
+  uint64_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i % table.chunkNodes == 0) {
+      table.chunks.push_back(
+          ChunkOffsets{static_cast<uint64_t>(lengthPos - lengths),
+                       static_cast<uint64_t>(randPos - rands), offset});
+    }
+    uint32_t value = readField(lengthPos, lengths + header.lengthsSize);
+    readField(randPos, rands + header.randsSize);
+    offset += dictionary ? 0 : value;
+  }
+}
+
+uint32_t SerializedListReader::readField(const char *&pos,
+                                         const char *end) const {
+  uint32_t value = 0;
+  if (header.flags & kColumnarVarint) {
+    pos = decodeVarints(pos, end, &value, 1);
+    return value;
+  }
+  if (end - pos < static_cast<ptrdiff_t>(sizeof(value))) {
+    throw std::runtime_error("Error reading columnar sections...stopped");
+  }
+  memcpy(&value, pos, sizeof(value));
+  pos += sizeof(value);
+  return value;
+}
+
+NodeRecord SerializedListReader::Read(size_t index) const {
+  if (index >= count) {
+    throw std::runtime_error("Node index out of range...stopped");
+  }
+  return ReadRange(index, 1).front();
+}
+
+std::vector<NodeRecord> SerializedListReader::ReadRange(size_t first,
+                                                        size_t n) const {
+  std::vector<NodeRecord> records;
+  if (first >= count) {
+    return records;
+  }
+  size_t last = first + std::min(n, count - first);
+  records.reserve(last - first);
+
+  if (!columnar) {
+    size_t start = first / stride * stride;
+    ByteReader in(file->Data() + offsets[start / stride], listEnd);
+    for (size_t i = start; i < last; i++) {
+      uint32_t dataSize = in.ReadUint32();
+      const char *bytes =
+          in.ReadBytes(dataSize, "Error reading node data...stopped");
+      int32_t randIndex = in.ReadInt32("Error reading rand index...stopped");
+      if (i >= first) {
+        records.push_back(
+            NodeRecord{std::string_view(bytes, dataSize), randIndex});
+      }
+    }
+    return records;
+  }
+
+  size_t chunk = first / table.chunkNodes;
+  const ChunkOffsets &at = table.chunks[chunk];
+  const char *lengthPos = lengths + at.lengths;
+  const char *randPos = rands + at.rands;
+  uint64_t offset = at.payload;
+  bool dictionary = header.flags & kColumnarDictionary;
+  size_t i = chunk * table.chunkNodes;
+  if (!(header.flags & kColumnarVarint)) {
+    // Fixed width fields: jump straight to first, only the payload offset
+    // needs the sizes in between.
+    for (; !dictionary && i < first; i++) {
+      uint32_t dataSize = 0;
+      memcpy(&dataSize, lengths + i * sizeof(uint32_t), sizeof(dataSize));
+      offset += dataSize;
+    }
+    i = first;
+    lengthPos = lengths + i * sizeof(uint32_t);
+    randPos = rands + i * sizeof(int32_t);
+  }
+  for (; i < last; i++) {
+    uint32_t value = readField(lengthPos, lengths + header.lengthsSize);
+    uint32_t randValue = readField(randPos, rands + header.randsSize);
+    std::string_view data;
+    if (dictionary) {
+      if (value >= entries.size()) {
+        throw std::runtime_error("Corrupt dictionary id...stopped");
+      }
+      data = entries[value];
+    } else {
+      if (offset > header.payloadSize ||
+          value > header.payloadSize - offset) {
+        throw std::runtime_error("Error reading node data...stopped");
+      }
+      data = std::string_view(payload + offset, value);
+      offset += value;
+    }
+    if (i >= first) {
+      records.push_back(NodeRecord{
+          data, List::randIndexFromValue(randValue, i, header.flags)});
+    }
+  }
+  return records;
+}
+
+// Reads the nodes of a serialized list one at a time, in order, without
+// building the list. Memory stays at a few buffers plus the largest payload
+// (and a dictionary, if the file has one), whatever the list size.
+// Columnar files need a seekable file: the three sections are read side by
+// side through pread. Afterwards the FILE* is positioned past the list,
+// except that interleaved lists leave it after the last node read.
+class NodeStream {
+public:
+  explicit NodeStream(FILE *file, size_t bufferSize = kDefaultWriteBufferSize);
+  // The buffers refer to the sources below.
+  NodeStream(const NodeStream &) = delete;
+  NodeStream &operator=(const NodeStream &) = delete;
+
+  size_t GetCount() const { return count; }
+  // Fills record with the next node, false once the list is exhausted. The
+  // record stays valid until the next call.
+  bool Next(NodeRecord &record);
+
+private:
+  template <typename Source>
+  uint32_t readField(ReadBuffer<Source> &in, const char *errorMessage);
+  template <typename Source>
+  static uint32_t readUint32(ReadBuffer<Source> &in);
+
+  size_t count = 0;
+  size_t position = 0;
+  uint32_t flags = 0;
+  bool columnar = false;
+  bool compressed = false;
+  FileSource file;
+  PreadSource lengthsSource;
+  PreadSource randsSource;
+  PreadSource payloadsSource;
+  std::unique_ptr<ReadBuffer<FileSource>> nodes; // header, interleaved nodes
+  std::unique_ptr<ReadBuffer<PreadSource>> lengths;
+  std::unique_ptr<ReadBuffer<PreadSource>> rands;
+  std::unique_ptr<ReadBuffer<PreadSource>> payloads;
+  std::shared_ptr<const void> dictionary;
+  std::vector<std::string_view> entries;
+};
+
+NodeStream::NodeStream(FILE *stream, size_t bufferSize) : file(stream) {
+  if (!stream) {
+    throw std::runtime_error("File not open for reading...stopped");
+  }
+
+  nodes = std::make_unique<ReadBuffer<FileSource>>(file, bufferSize);
+  uint32_t first = readUint32(*nodes);
+  if (first == kCompressedMagic) {
+    compressed = true;
+    nodes->BeginCompressedBlocks();
+    first = readUint32(*nodes);
+    if (first == kColumnarMagic) {
+      throw std::runtime_error(
+          "Columnar lists in compressed files can't be streamed...stopped");
+    }
+  }
+  if (first != kColumnarMagic) {
+    count = first;
+    if (count == 0 && compressed) {
+      nodes->EndCompressedBlocks();
+    }
+    return;
+  }
+
+  columnar = true;
+  const char *raw = nodes->Read(sizeof(ColumnarHeader) - sizeof(uint32_t),
+                                "Error reading header...stopped");
+  ByteReader headerReader(raw, raw + sizeof(ColumnarHeader) - sizeof(uint32_t));
+  ColumnarHeader header = List::readColumnarHeader(headerReader);
+  count = header.count;
+  flags = header.flags;
+
+  off_t start = ftello(stream);
+  if (start < 0) {
+    throw std::runtime_error(
+        "Columnar streaming needs a seekable file...stopped");
+  }
+  if (flags & kColumnarChunkTable) {
+    uint32_t chunkCount = 0;
+    memcpy(&chunkCount,
+           nodes->Read(2 * sizeof(uint32_t),
+                       "Error reading chunk table...stopped") +
+               sizeof(uint32_t),
+           sizeof(chunkCount));
+    if (chunkCount > uint64_t{count} + 1) {
+      throw std::runtime_error("Corrupt chunk table...stopped");
+    }
+    start += 2 * sizeof(uint32_t) + off_t{chunkCount} * sizeof(ChunkOffsets);
+  }
+
+  int fd = fileno(stream);
+  off_t randsStart = start + static_cast<off_t>(header.lengthsSize);
+  off_t payloadStart = randsStart + static_cast<off_t>(header.randsSize);
+  lengthsSource = PreadSource(fd, start, header.lengthsSize);
+  randsSource = PreadSource(fd, randsStart, header.randsSize);
+  payloadsSource = PreadSource(fd, payloadStart, header.payloadSize);
+  nodes.reset();
+  lengths = std::make_unique<ReadBuffer<PreadSource>>(lengthsSource,
+                                                      bufferSize);
+  rands = std::make_unique<ReadBuffer<PreadSource>>(randsSource, bufferSize);
+  payloads = std::make_unique<ReadBuffer<PreadSource>>(payloadsSource,
+                                                       bufferSize);
+  if (flags & kColumnarDictionary) {
+    const char *bytes = payloads->Read(header.payloadSize,
+                                       "Error reading dictionary...stopped");
+    // The entries outlive the payloads buffer.
+    auto backing =
+        std::make_shared<const std::string>(bytes, header.payloadSize);
+    entries = List::readDictionary(backing->data(),
+                                   backing->data() + backing->size(), flags);
+    dictionary = std::move(backing);
+    payloads.reset();
+  }
+
+  if (fseeko(stream, payloadStart + static_cast<off_t>(header.payloadSize),
+             SEEK_SET) != 0) {
+    throw std::runtime_error("Error seeking past the list...stopped");
+  }
+}
+
+template <typename Source>
+uint32_t NodeStream::readUint32(ReadBuffer<Source> &in) {
+  uint32_t value = 0;
+  memcpy(&value,
+         in.Read(sizeof(value), "Error reading uint32_t value...stopped"),
+         sizeof(value));
+  return value;
+}
+
+template <typename Source>
+uint32_t NodeStream::readField(ReadBuffer<Source> &in,
+                               const char *errorMessage) {
+  if (!(flags & kColumnarVarint)) {
+    uint32_t value = 0;
+    memcpy(&value, in.Read(sizeof(value), errorMessage), sizeof(value));
+    return value;
+  }
+
+  uint32_t value = 0;
+  for (size_t shift = 0;; shift += 7) {
+    if (shift >= 7 * kMaxVarintSize) {
+      throw std::runtime_error("Error reading varint...stopped");
+    }
+    uint8_t byte = static_cast<uint8_t>(*in.Read(1, errorMessage));
+    if (shift == 28 && byte > 0x0F) {
+      throw std::runtime_error("Error reading varint...stopped");
+    }
+    value |= uint32_t{byte & 0x7Fu} << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+bool NodeStream::Next(NodeRecord &record) {
+  if (position == count) {
+    return false;
+  }
+
+  if (!columnar) {
+    uint32_t dataSize = readUint32(*nodes);
+    // Payload and rand in one piece, so the payload stays put.
+    const char *bytes = nodes->Read(size_t{dataSize} + sizeof(int32_t),
+                                    "Error reading node data...stopped");
+    record.data = std::string_view(bytes, dataSize);
+    memcpy(&record.rand, bytes + dataSize, sizeof(record.rand));
+  } else {
+    uint32_t value = readField(*lengths, "Error reading data sizes...stopped");
+    uint32_t randValue =
+        readField(*rands, "Error reading rand indices...stopped");
+    record.rand = List::randIndexFromValue(randValue, position, flags);
+    if (flags & kColumnarDictionary) {
+      if (value >= entries.size()) {
+        throw std::runtime_error("Corrupt dictionary id...stopped");
+      }
+      record.data = entries[value];
+    } else {
+      record.data = std::string_view(
+          payloads->Read(value, "Error reading node data...stopped"), value);
+    }
+  }
+
+  position++;
+  if (position == count && compressed) {
+    nodes->EndCompressedBlocks();
+  }
+  return true;
+}
+
+void List::DeserializeFiltered(FILE *file, const NodeFilter &keep,
+                               DroppedRand dropped) {
+  Clear();
+
+  std::vector<int32_t> newIndex; // by file position, -1 when dropped
+  std::vector<int32_t> fileRands; // every node's rand, for Follow
+  std::vector<int32_t> randIndices; // kept nodes' rand, by file position
+  try {
+    NodeStream stream(file);
+    NodeRecord record;
+    for (size_t i = 0; stream.Next(record); i++) {
+      bool kept = keep(i, record.data);
+      newIndex.push_back(kept ? static_cast<int32_t>(positions.size()) : -1);
+      if (dropped == DroppedRand::Follow) {
+        fileRands.push_back(record.rand);
+      }
+      if (!kept) {
+        continue;
+      }
+      ListNode *node = arena.Allocate();
+      node->data.assign(record.data);
+      linkBack(node);
+      randIndices.push_back(record.rand);
+    }
+  } catch (...) {
+    Clear();
+    throw;
+  }
+
+  // Follow remembers where each dropped node's chain ended, so every node
+  // is walked once. kOnChain marks the chain being walked to catch loops.
+  constexpr int32_t kUnresolved = -2;
+  constexpr int32_t kOnChain = -3;
+  size_t n = newIndex.size();
+  std::vector<int32_t> chainEnd(fileRands.size(), kUnresolved);
+  std::vector<int32_t> chain;
+  auto resolve = [&](int32_t target) {
+    int32_t result = -1;
+    chain.clear();
+    while (target >= 0 && static_cast<size_t>(target) < n) {
+      if (newIndex[target] >= 0) {
+        result = newIndex[target];
+        break;
+      }
+      if (dropped != DroppedRand::Follow) {
+        break;
+      }
+      if (chainEnd[target] != kUnresolved) {
+        result = chainEnd[target] == kOnChain ? -1 : chainEnd[target];
+        break;
+      }
+      chainEnd[target] = kOnChain;
+      chain.push_back(target);
+      target = fileRands[target];
+    }
+    for (int32_t link : chain) {
+      chainEnd[link] = result;
+    }
+    return result;
+  };
+
+  for (int32_t &randIndex : randIndices) {
+    randIndex = resolve(randIndex);
+  }
+  setupRandPointers(positions, randIndices, 0, positions.size());
+}
+
+// The List API over structure-of-arrays storage: per node a payload offset
+// and length into one byte pool and a 32-bit rand index, nothing else.
+// Nodes are only appended, so node i's prev and next are i - 1 and i + 1
+// and need no arrays of their own. The lengths and rand arrays are the
+// fixed-width columnar sections as they are, so a columnar Serialize is a
+// header plus three array writes.
+class IndexedList {
+public:
+  void AddNode(std::string_view data);
+  template <typename... Args> void EmplaceNode(Args &&...args) {
+    AddNode(std::string(std::forward<Args>(args)...));
+  }
+  void SetRand(int nodeIndex, int randIndex);
+  void SetRandBatch(std::span<const int32_t> randIndices);
+  int GetCount() const { return static_cast<int>(lengths.size()); }
+  // Payload and rand index (-1 for nullptr) of node index, in range.
+  std::string_view GetData(int index) const;
+  int32_t GetRand(int index) const { return rands[index]; }
+  void Clear();
+  void PrintList() const;
+
+  // Fixed-width formats only: no varint, rand deltas, dictionary,
+  // compression, index footer or threads.
+  void Serialize(FILE *file,
+                 const SerializeOptions &options = SerializeOptions());
+  template <ByteSink Sink>
+  void Serialize(Sink &sink,
+                 const SerializeOptions &options = SerializeOptions());
+  std::vector<std::byte>
+  SerializeToBuffer(const SerializeOptions &options = SerializeOptions());
+  // Anything NodeStream reads, one node at a time.
+  void Deserialize(FILE *file);
+  // Anything List writes, parsed from a mapping of the file or from bytes
+  // in memory. Payloads are copied into the pool, so the bytes can go.
+  void Deserialize(const std::string &path);
+  void Deserialize(int fd);
+  void DeserializeFrom(std::span<const std::byte> bytes);
+
+private:
+  void deserializeMemory(const char *begin, const char *end);
+  void dropInvalidRands();
+
+  // 64-bit, as the pool may pass 4 GiB even though lengths fit in 32 bits.
+  std::vector<uint64_t> offsets; // into pool
+  std::vector<uint32_t> lengths;
+  std::vector<int32_t> rands;
+  std::vector<char> pool;
+};
+
+void IndexedList::AddNode(std::string_view data) {
+  size_t offset = pool.size();
+  offsets.push_back(offset);
+  lengths.push_back(static_cast<uint32_t>(data.size()));
+  rands.push_back(-1);
+
+  // data may be another node's payload, which growing the pool moves.
+  std::less_equal<const char *> notAfter;
+  bool inPool = !data.empty() && notAfter(pool.data(), data.data()) &&
+                notAfter(data.data() + data.size(), pool.data() + offset);
+  if (inPool) {
+    size_t from = data.data() - pool.data();
+    pool.resize(offset + data.size());
+    memcpy(pool.data() + offset, pool.data() + from, data.size());
+  } else {
+    pool.insert(pool.end(), data.begin(), data.end());
+  }
+}
+
+void IndexedList::SetRand(int nodeIndex, int randIndex) {
+  int count = GetCount();
+  if (nodeIndex < 0 || nodeIndex >= count || randIndex < 0 ||
+      randIndex >= count) {
+    return;
+  }
+  rands[nodeIndex] = randIndex;
+}
+
+void IndexedList::SetRandBatch(std::span<const int32_t> randIndices) {
+  if (randIndices.size() != rands.size()) {
+    throw std::runtime_error(
+        "Rand index count doesn't match the list...stopped");
+  }
+  size_t n = rands.size();
+  for (size_t i = 0; i < n; i++) {
+    int32_t randIndex = randIndices[i];
+    rands[i] = randIndex >= 0 && static_cast<size_t>(randIndex) < n
+                   ? randIndex
+                   : -1;
+  }
+}
+
+std::string_view IndexedList::GetData(int index) const {
+  return std::string_view(pool.data() + offsets[index], lengths[index]);
+}
+
+void IndexedList::Clear() {
+  offsets = {};
+  lengths = {};
+  rands = {};
+  pool = {};
+}
+
+void IndexedList::PrintList() const {
+  for (int index = 0; index < GetCount(); index++) {
+    std::cout << "Node " << index << ": data = " << GetData(index)
+              << ", rand = ";
+    if (rands[index] >= 0)
+      std::cout << GetData(rands[index]);
+    else
+      std::cout << "nullptr";
+    std::cout << std::endl;
+  }
+}
+
+void IndexedList::Serialize(FILE *file, const SerializeOptions &options) {
+  if (!file) {
+    throw std::runtime_error("File not open for writing...stopped");
+  }
+  FileSink sink(file);
+  Serialize(sink, options);
+}
+
+template <ByteSink Sink>
+void IndexedList::Serialize(Sink &sink, const SerializeOptions &options) {
+  if (options.varint || options.randDelta || options.dictionary ||
+      options.compressBlockSize > 0 || options.indexStride > 0 ||
+      options.threads != 1) {
+    throw std::runtime_error(
+        "IndexedList writes fixed-width uncompressed lists only...stopped");
+  }
+
+  size_t n = lengths.size();
+  WriteBuffer out(sink, options.bufferSize);
+  if (options.format == Format::Interleaved) {
+    uint32_t ucount = static_cast<uint32_t>(n);
+    out.Write(&ucount, sizeof(ucount), "Error writing count...stopped");
+    for (size_t i = 0; i < n; i++) {
+      out.Write(&lengths[i], sizeof(uint32_t),
+                "Error writing data size...stopped");
+      out.Write(pool.data() + offsets[i], lengths[i],
+                "Error writing data...stopped");
+      out.Write(&rands[i], sizeof(int32_t),
+                "Error writing rand index...stopped");
+    }
+    out.Flush();
+    return;
+  }
+
+  ColumnarHeader header;
+  header.count = static_cast<uint32_t>(n);
+  header.lengthsSize = n * sizeof(uint32_t);
+  header.randsSize = n * sizeof(int32_t);
+  header.payloadSize = pool.size();
+  ChunkTable table;
+  table.chunkNodes = options.chunkNodes;
+  if (table.chunkNodes > 0) {
+    header.flags |= kColumnarChunkTable;
+    for (size_t i = 0; i < n; i += table.chunkNodes) {
+      table.chunks.push_back(ChunkOffsets{i * sizeof(uint32_t),
+                                          i * sizeof(int32_t), offsets[i]});
+    }
+  }
+  List::writeColumnarPrefix(out, header, table);
+  out.Flush();
+
+  // The sections are the arrays themselves, no need to copy them through
+  // the buffer.
+  auto writeSection = [&sink](const void *bytes, size_t size,
+                              const char *errorMessage) {
+    if (size > 0 &&
+        sink.Write(static_cast<const char *>(bytes), size) != size) {
+      throw std::runtime_error(errorMessage);
+    }
+  };
+  writeSection(lengths.data(), header.lengthsSize,
+               "Error writing data size...stopped");
+  writeSection(rands.data(), header.randsSize,
+               "Error writing rand index...stopped");
+  writeSection(pool.data(), pool.size(), "Error writing data...stopped");
+}
+
+std::vector<std::byte>
+IndexedList::SerializeToBuffer(const SerializeOptions &options) {
+  CountingSink counter;
+  Serialize(counter, options);
+  std::vector<std::byte> bytes(counter.GetCount());
+  SpanSink sink(reinterpret_cast<char *>(bytes.data()), bytes.size());
+  Serialize(sink, options);
+  return bytes;
+}
+
+void IndexedList::Deserialize(FILE *file) {
+  Clear();
+  try {
+    NodeStream stream(file);
+    size_t count = stream.GetCount();
+    offsets.reserve(count);
+    lengths.reserve(count);
+    rands.reserve(count);
+    NodeRecord record;
+    while (stream.Next(record)) {
+      AddNode(record.data);
+      rands.back() = record.rand;
+    }
+  } catch (...) {
+    Clear();
+    throw;
+  }
+  dropInvalidRands();
+}
+
+void IndexedList::Deserialize(const std::string &path) {
+  MappedFile mapped(path);
+  deserializeMemory(mapped.Data(), mapped.Data() + mapped.Size());
+}
+
+void IndexedList::Deserialize(int fd) {
+  MappedFile mapped(fd);
+  deserializeMemory(mapped.Data(), mapped.Data() + mapped.Size());
+}
+
+void IndexedList::DeserializeFrom(std::span<const std::byte> bytes) {
+  const char *begin = reinterpret_cast<const char *>(bytes.data());
+  deserializeMemory(begin, begin + bytes.size());
+}
+
+void IndexedList::deserializeMemory(const char *begin, const char *end) {
+  Clear();
+  try {
+    std::vector<char> stream;
+    ByteReader probe(begin, end);
+    if (probe.Remaining() >= sizeof(uint32_t) &&
+        probe.ReadUint32() == kCompressedMagic) {
+      stream = inflateBlocks(probe, 1);
+      begin = stream.data();
+      end = begin + stream.size();
+    }
+
+    ByteReader in(begin, end);
+    uint32_t newCount = in.ReadUint32();
+    if (newCount != kColumnarMagic) {
+      // Every node takes at least 8 bytes, don't trust the count beyond
+      // that.
+      size_t expected = std::min<size_t>(newCount, in.Remaining() / 8);
+      offsets.reserve(expected);
+      lengths.reserve(expected);
+      rands.reserve(expected);
+      pool.reserve(in.Remaining() - expected * 8);
+      for (size_t i = 0; i < newCount; i++) {
+        uint32_t dataSize = in.ReadUint32();
+        AddNode(std::string_view(
+            in.ReadBytes(dataSize, "Error reading node data...stopped"),
+            dataSize));
+        rands.back() = in.ReadInt32("Error reading rand index...stopped");
+      }
+    } else {
+      ColumnarHeader header = List::readColumnarHeader(in);
+      ChunkTable table;
+      if (header.flags & kColumnarChunkTable) {
+        table = List::readChunkTable(header, in);
+      }
+      const char *lengthBytes = in.ReadBytes(
+          header.lengthsSize, "Error reading data sizes...stopped");
+      const char *randBytes = in.ReadBytes(
+          header.randsSize, "Error reading rand indices...stopped");
+      const char *payload = in.ReadBytes(header.payloadSize,
+                                         "Error reading node data...stopped");
+      std::vector<uint32_t> sizes;
+      std::vector<int32_t> randIndices(header.count);
+      List::decodeColumnarFields(header, table, lengthBytes, randBytes, sizes,
+                                 randIndices, 1);
+      if (!(header.flags & kColumnarVarint)) {
+        sizes.resize(header.count);
+        std::copy_n(lengthBytes, header.lengthsSize,
+                    reinterpret_cast<char *>(sizes.data()));
+      }
+
+      offsets.reserve(header.count);
+      lengths.reserve(header.count);
+      if (header.flags & kColumnarDictionary) {
+        // sizes holds dictionary ids.
+        std::vector<std::string_view> entries = List::readDictionary(
+            payload, payload + header.payloadSize, header.flags);
+        for (uint32_t id : sizes) {
+          if (id >= entries.size()) {
+            throw std::runtime_error("Corrupt dictionary id...stopped");
+          }
+          AddNode(entries[id]);
+        }
+      } else {
+        pool.reserve(header.payloadSize);
+        uint64_t offset = 0;
+        for (uint32_t dataSize : sizes) {
+          if (dataSize > header.payloadSize - offset) {
+            throw std::runtime_error("Error reading node data...stopped");
+          }
+          AddNode(std::string_view(payload + offset, dataSize));
+          offset += dataSize;
+        }
+        if (offset != header.payloadSize) {
+          throw std::runtime_error("Error reading node data...stopped");
+        }
+      }
+      rands = std::move(randIndices);
+    }
+  } catch (...) {
+    Clear();
+    throw;
+  }
+  dropInvalidRands();
+}
+
+// As List does, rand indices outside the list become nullptr.
+void IndexedList::dropInvalidRands() {
+  for (int32_t &randIndex : rands) {
+    if (randIndex < -1 || randIndex >= GetCount()) {
+      randIndex = -1;
+    }
+  }
+}
+
+// -------------------- Test Functions --------------------
+
+// Counts every global operator new, for tests of how often a call
+// allocates.
+std::atomic<size_t> allocationCount{0};
+
+void *operator new(size_t size) {
+  allocationCount++;
+  if (void *memory = malloc(size > 0 ? size : 1)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+// Out of line, so the compiler doesn't pair free with new at call sites.
+[[gnu::noinline]] void operator delete(void *memory) noexcept {
+  free(memory);
+}
+
+[[gnu::noinline]] void operator delete(void *memory, size_t) noexcept {
+  free(memory);
+}
+
+void TestEmptyList() {
+  List list;
+
+  {
+    FILE *file = fopen("temp_empty.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing...stopped");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  List deserialized;
+  {
+    FILE *file = fopen("temp_empty.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading...stopped");
+    }
+    deserialized.Deserialize(file);
+    fclose(file);
+  }
+  assert(deserialized.GetCount() == 0);
+  std::cout << "TestEmptyList passed" << std::endl;
+}
+
+void TestSingleNode() {
+  List list;
+  list.AddNode("SingleNode");
+  list.SetRand(0, 0); // self-reference
+  {
+    FILE *file = fopen("temp_single.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  List deserialized;
+  {
+    FILE *file = fopen("temp_single.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    deserialized.Deserialize(file);
+    fclose(file);
+  }
+  assert(deserialized.GetCount() == 1);
+  std::cout << "TestSingleNode:" << std::endl;
+  deserialized.PrintList();
+  std::cout << "TestSingleNode passed" << std::endl;
+}
+
+void TestMultipleNodes() {
+  List list;
+  list.AddNode("Node1");
+  list.AddNode("Node2");
+  list.AddNode("Node3");
+  list.AddNode("Node4");
+  list.AddNode("Node5");
+  list.SetRand(0, 2);
+  list.SetRand(1, 4);
+  list.SetRand(2, 0);
+  list.SetRand(3, 3);
+  list.SetRand(4, 1);
+
+  {
+    FILE *file = fopen("temp_multiple.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  List deserialized;
+  {
+    FILE *file = fopen("temp_multiple.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading...stopped");
+    }
+    deserialized.Deserialize(file);
+    fclose(file);
+  }
+  assert(deserialized.GetCount() == 5);
+  std::cout << "TestMultipleNodes:" << std::endl;
+  deserialized.PrintList();
+  std::cout << "TestMultipleNodes passed" << std::endl;
+}
+
+void TestBufferedWriter() {
+  FILE *raw = fopen("temp_buffered.dat", "wb+");
+  if (!raw) {
+    throw std::runtime_error("Can't open file for writing");
+  }
+
+  // 10 fields of 4 bytes through a 16 byte buffer: 40 bytes, 3 fwrite calls.
+  FileSink sink(raw);
+  WriteBuffer out(sink, 16);
+  for (uint32_t i = 0; i < 10; i++) {
+    out.Write(&i, sizeof(i), "Error writing value...stopped");
+  }
+  out.Flush();
+  assert(out.GetFlushCount() == 3);
+
+  rewind(raw);
+  for (uint32_t i = 0; i < 10; i++) {
+    uint32_t value = 0;
+    size_t readCount = fread(&value, sizeof(value), 1, raw);
+    assert(readCount == 1 && value == i);
+  }
+  fclose(raw);
+
+  List list;
+  for (int i = 0; i < 100; i++) {
+    list.AddNode("Node" + std::to_string(i));
+    list.SetRand(i, (i * 7) % 100);
+  }
+  SerializeOptions options;
+  options.bufferSize = 7; // smaller than most fields, forces split writes
+  {
+    FILE *file = fopen("temp_buffered.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, options);
+    fclose(file);
+  }
+  List deserialized;
+  {
+    FILE *file = fopen("temp_buffered.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    deserialized.Deserialize(file);
+    fclose(file);
+  }
+  assert(deserialized.GetCount() == 100);
+  std::cout << "TestBufferedWriter passed" << std::endl;
+}
+
+void TestMappedDeserialize() {
+  List list;
+  list.AddNode("First");
+  list.AddNode("");
+  list.AddNode("Third");
+  list.SetRand(0, 2);
+  list.SetRand(2, 1);
+  {
+    FILE *file = fopen("temp_mapped.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  List byPath;
+  byPath.Deserialize(std::string("temp_mapped.dat"));
+  assert(byPath.GetCount() == 3);
+
+  List byFd;
+  int fd = open("temp_mapped.dat", O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Can't open file for reading");
+  }
+  byFd.Deserialize(fd);
+  close(fd);
+  assert(byFd.GetCount() == 3);
+  std::cout << "TestMappedDeserialize:" << std::endl;
+  byFd.PrintList();
+
+  // A file cut in the middle of a node is rejected and leaves the list empty.
+  {
+    FILE *file = fopen("temp_mapped.dat", "r+b");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    if (ftruncate(fileno(file), 10) != 0) {
+      throw std::runtime_error("Can't truncate file");
+    }
+    fclose(file);
+  }
+  bool threw = false;
+  try {
+    byPath.Deserialize(std::string("temp_mapped.dat"));
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  assert(threw && byPath.GetCount() == 0);
+  std::cout << "TestMappedDeserialize passed" << std::endl;
+}
+
+void TestArenaBlocks() {
+  // Enough nodes to span several arena blocks, then reuse after Clear.
+  List list;
+  for (int round = 0; round < 2; round++) {
+    list.Clear();
+    for (int i = 0; i < 5000; i++) {
+      list.AddNode(std::to_string(i));
+      list.SetRand(i, i / 2);
+    }
+  }
+  assert(list.GetCount() == 5000);
+  {
+    FILE *file = fopen("temp_arena.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  List deserialized;
+  deserialized.AddNode("replaced by Deserialize");
+  {
+    FILE *file = fopen("temp_arena.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    deserialized.Deserialize(file);
+    fclose(file);
+  }
+  assert(deserialized.GetCount() == 5000);
+  std::cout << "TestArenaBlocks passed" << std::endl;
+}
+
+std::vector<char> ReadFileBytes(const char *path) {
+  std::vector<char> bytes;
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for reading");
+  }
+  char chunk[4096];
+  size_t got = 0;
+  while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    bytes.insert(bytes.end(), chunk, chunk + got);
+  }
+  fclose(file);
+  return bytes;
+}
+
+void TestRandIndexRoundTrip() {
+  List list;
+  for (int i = 0; i < 1000; i++) {
+    list.AddNode("Node" + std::to_string(i));
+  }
+  for (int i = 0; i < 1000; i += 3) {
+    list.SetRand(i, (i * 37 + 11) % 1000);
+  }
+  {
+    FILE *file = fopen("temp_rand.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  List deserialized;
+  deserialized.Deserialize(std::string("temp_rand.dat"));
+  {
+    FILE *file = fopen("temp_rand_again.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    deserialized.Serialize(file);
+    fclose(file);
+  }
+  // Identical bytes mean every rand pointer came back to the same index.
+  assert(ReadFileBytes("temp_rand.dat") ==
+         ReadFileBytes("temp_rand_again.dat"));
+  std::cout << "TestRandIndexRoundTrip passed" << std::endl;
+}
+
+void TestColumnarFormat() {
+  List list;
+  for (int i = 0; i < 300; i++) {
+    list.AddNode(i % 10 == 0 ? std::string() : "Node" + std::to_string(i));
+    list.SetRand(i, (i * 13) % 300);
+  }
+  {
+    FILE *file = fopen("temp_interleaved.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  SerializeOptions options;
+  options.format = Format::Columnar;
+  {
+    FILE *file = fopen("temp_columnar.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, options);
+    fclose(file);
+  }
+
+  // Both readers detect the columnar header on their own.
+  List fromFile;
+  {
+    FILE *file = fopen("temp_columnar.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    fromFile.Deserialize(file);
+    fclose(file);
+  }
+  List fromMapping;
+  fromMapping.Deserialize(std::string("temp_columnar.dat"));
+  assert(fromFile.GetCount() == 300 && fromMapping.GetCount() == 300);
+
+  for (List *loaded : {&fromFile, &fromMapping}) {
+    FILE *file = fopen("temp_columnar_again.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    loaded->Serialize(file);
+    fclose(file);
+    assert(ReadFileBytes("temp_columnar_again.dat") ==
+           ReadFileBytes("temp_interleaved.dat"));
+  }
+  std::cout << "TestColumnarFormat passed" << std::endl;
+}
+
+void TestParallelDeserialize() {
+  List list;
+  for (int i = 0; i < 10000; i++) {
+    list.AddNode(std::string(i % 17, 'a' + i % 26));
+  }
+  for (int i = 0; i < 10000; i += 7) {
+    list.SetRand(i, 9999 - i);
+  }
+  {
+    FILE *file = fopen("temp_parallel_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  // With a small chunk table, and without one (offsets rebuilt on load).
+  for (uint32_t chunkNodes : {100u, 0u}) {
+    SerializeOptions options;
+    options.format = Format::Columnar;
+    options.chunkNodes = chunkNodes;
+    {
+      FILE *file = fopen("temp_parallel.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+
+    for (unsigned threads : {4u, 0u}) {
+      DeserializeOptions loadOptions;
+      loadOptions.threads = threads;
+      List fromFile;
+      {
+        FILE *file = fopen("temp_parallel.dat", "rb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for reading");
+        }
+        fromFile.Deserialize(file, loadOptions);
+        fclose(file);
+      }
+      List fromMapping;
+      fromMapping.Deserialize(std::string("temp_parallel.dat"), loadOptions);
+
+      for (List *loaded : {&fromFile, &fromMapping}) {
+        assert(loaded->GetCount() == 10000);
+        FILE *file = fopen("temp_parallel_again.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        loaded->Serialize(file);
+        fclose(file);
+        assert(ReadFileBytes("temp_parallel_again.dat") ==
+               ReadFileBytes("temp_parallel_ref.dat"));
+      }
+    }
+  }
+  std::cout << "TestParallelDeserialize passed" << std::endl;
+}
+
+void TestParallelSerialize() {
+  List list;
+  for (int i = 0; i < 5000; i++) {
+    list.AddNode(std::string(i % 23, 'A' + i % 26));
+    list.SetRand(i, (i * 31) % 5000);
+  }
+
+  for (Format format : {Format::Interleaved, Format::Columnar}) {
+    for (uint32_t chunkNodes : {64u, 0u}) {
+      SerializeOptions options;
+      options.format = format;
+      options.chunkNodes = chunkNodes;
+      {
+        FILE *file = fopen("temp_serial.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        fclose(file);
+      }
+
+      // Two lists back to back: the second starts where the first ended.
+      options.threads = 4;
+      {
+        FILE *file = fopen("temp_pwrite.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      std::vector<char> serial = ReadFileBytes("temp_serial.dat");
+      std::vector<char> twice = serial;
+      twice.insert(twice.end(), serial.begin(), serial.end());
+      assert(ReadFileBytes("temp_pwrite.dat") == twice);
+
+      List first;
+      List second;
+      FILE *file = fopen("temp_pwrite.dat", "rb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for reading");
+      }
+      first.Deserialize(file);
+      second.Deserialize(file);
+      fclose(file);
+      assert(first.GetCount() == 5000 && second.GetCount() == 5000);
+    }
+  }
+
+  // Append mode would scatter the pieces, so it is refused up front.
+  SerializeOptions options;
+  options.format = Format::Columnar;
+  options.threads = 4;
+  FILE *file = fopen("temp_pwrite.dat", "ab");
+  if (!file) {
+    throw std::runtime_error("Can't open file for appending");
+  }
+  bool threw = false;
+  try {
+    list.Serialize(file, options);
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  fclose(file);
+  assert(threw);
+  std::cout << "TestParallelSerialize passed" << std::endl;
+}
+
+void TestVarintEncoding() {
+  for (uint32_t value : {0u, 1u, 127u, 128u, 16383u, 16384u, 0xFFFFFFFFu}) {
+    char bytes[kMaxVarintSize + 8] = {};
+    size_t size = encodeVarint(value, bytes);
+    assert(size == varintSize(value));
+    uint32_t decoded = 0;
+    const char *after = decodeVarints(bytes, bytes + size, &decoded, 1);
+    assert(after == bytes + size && decoded == value);
+  }
+
+  List list;
+  for (int i = 0; i < 3000; i++) {
+    list.AddNode(std::string(i % 300, 'x'));
+    list.SetRand(i, (i * 101) % 3000);
+  }
+  {
+    FILE *file = fopen("temp_varint_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  SerializeOptions fixed;
+  fixed.format = Format::Columnar;
+  {
+    FILE *file = fopen("temp_fixed.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, fixed);
+    fclose(file);
+  }
+  size_t fixedSize = ReadFileBytes("temp_fixed.dat").size();
+
+  for (uint32_t chunkNodes : {50u, 0u}) {
+    for (unsigned threads : {1u, 4u}) {
+      SerializeOptions options;
+      options.format = Format::Columnar;
+      options.varint = true;
+      options.chunkNodes = chunkNodes;
+      options.threads = threads;
+      {
+        FILE *file = fopen("temp_varint.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      size_t varintFileSize = ReadFileBytes("temp_varint.dat").size();
+      assert(varintFileSize < fixedSize);
+
+      DeserializeOptions loadOptions;
+      loadOptions.threads = threads;
+      List loaded;
+      loaded.Deserialize(std::string("temp_varint.dat"), loadOptions);
+      FILE *file = fopen("temp_varint_again.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      loaded.Serialize(file);
+      fclose(file);
+      assert(ReadFileBytes("temp_varint_again.dat") ==
+             ReadFileBytes("temp_varint_ref.dat"));
+    }
+  }
+  std::cout << "TestVarintEncoding passed" << std::endl;
+}
+
+void TestRandDeltaEncoding() {
+  // Rand pointers within a few nodes of their owner, plus some nullptr.
+  List list;
+  for (int i = 0; i < 4000; i++) {
+    list.AddNode("n");
+  }
+  for (int i = 0; i < 4000; i++) {
+    if (i % 5 != 0) {
+      list.SetRand(i, std::clamp(i + (i % 11) - 5, 0, 3999));
+    }
+  }
+  list.SetRand(0, 3999);
+  list.SetRand(3999, 0);
+  {
+    FILE *file = fopen("temp_delta_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  size_t sizes[2][2] = {};
+  for (bool varint : {false, true}) {
+    for (bool randDelta : {false, true}) {
+      SerializeOptions options;
+      options.format = Format::Columnar;
+      options.varint = varint;
+      options.randDelta = randDelta;
+      options.chunkNodes = 1000;
+      {
+        FILE *file = fopen("temp_delta.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      sizes[varint][randDelta] = ReadFileBytes("temp_delta.dat").size();
+
+      DeserializeOptions loadOptions;
+      loadOptions.threads = 2;
+      List loaded;
+      loaded.Deserialize(std::string("temp_delta.dat"), loadOptions);
+      FILE *file = fopen("temp_delta_again.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      loaded.Serialize(file);
+      fclose(file);
+      assert(ReadFileBytes("temp_delta_again.dat") ==
+             ReadFileBytes("temp_delta_ref.dat"));
+    }
+  }
+  assert(sizes[false][true] == sizes[false][false]);
+  assert(sizes[true][true] < sizes[true][false]);
+  std::cout << "TestRandDeltaEncoding passed" << std::endl;
+}
+
+void TestBlockCompression() {
+  // Incompressible input goes out as a stored block, repetitive input shrinks.
+  std::vector<char> noise(5000);
+  uint32_t seed = 12345;
+  for (char &byte : noise) {
+    seed = seed * 1103515245 + 12345;
+    byte = static_cast<char>(seed >> 24);
+  }
+  std::string text;
+  for (int i = 0; i < 200; i++) {
+    text += "status=OK tenant=acme id=" + std::to_string(i % 7) + ";";
+  }
+  for (const std::string &input :
+       {std::string(noise.begin(), noise.end()), text, std::string("ab")}) {
+    std::vector<char> packed;
+    size_t packedSize = lzCompress(input.data(), input.size(), packed);
+    if (packedSize < input.size()) {
+      std::string output(input.size(), '\0');
+      lzDecompress(packed.data(), packedSize, &output[0], output.size());
+      assert(output == input);
+    }
+  }
+  std::vector<char> packed;
+  size_t textPackedSize = lzCompress(text.data(), text.size(), packed);
+  assert(textPackedSize < text.size() / 4);
+
+  List list;
+  for (int i = 0; i < 3000; i++) {
+    list.AddNode("tenant-" + std::to_string(i % 13) + "/status-200");
+    list.SetRand(i, (i * 7) % 3000);
+  }
+  {
+    FILE *file = fopen("temp_compressed_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+  size_t rawSize = ReadFileBytes("temp_compressed_ref.dat").size();
+
+  for (Format format : {Format::Interleaved, Format::Columnar}) {
+    for (size_t blockSize : {size_t{100}, size_t{4096}, size_t{1} << 20}) {
+      SerializeOptions options;
+      options.format = format;
+      options.compressBlockSize = blockSize;
+      {
+        FILE *file = fopen("temp_compressed.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      assert(ReadFileBytes("temp_compressed.dat").size() < rawSize);
+
+      DeserializeOptions loadOptions;
+      loadOptions.threads = 3;
+      // Through FILE* each container is inflated block by block and the
+      // file is left at whatever follows it.
+      {
+        FILE *file = fopen("temp_compressed_twice.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      List fromFile;
+      List second;
+      {
+        FILE *file = fopen("temp_compressed_twice.dat", "rb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for reading");
+        }
+        fromFile.Deserialize(file, loadOptions);
+        second.Deserialize(file, loadOptions);
+        assert(fgetc(file) == EOF);
+        fclose(file);
+      }
+      List fromMapping;
+      fromMapping.Deserialize(std::string("temp_compressed.dat"), loadOptions);
+
+      for (List *loaded : {&fromFile, &second, &fromMapping}) {
+        FILE *file = fopen("temp_compressed_again.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        loaded->Serialize(file);
+        fclose(file);
+        assert(ReadFileBytes("temp_compressed_again.dat") ==
+               ReadFileBytes("temp_compressed_ref.dat"));
+      }
+    }
+  }
+
+  // A block can't claim to inflate further than the format allows, so a
+  // tiny corrupt file never makes the reader allocate a huge output.
+  uint32_t bomb[] = {kCompressedMagic, 1u << 30, 1u << 30, 1, 0, 0};
+  {
+    FILE *file = fopen("temp_compressed.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    fwrite(bomb, 1, sizeof(bomb), file);
+    fclose(file);
+  }
+  for (bool mapped : {false, true}) {
+    List loaded;
+    bool threw = false;
+    try {
+      if (mapped) {
+        loaded.Deserialize(std::string("temp_compressed.dat"));
+      } else {
+        FILE *file = fopen("temp_compressed.dat", "rb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for reading");
+        }
+        try {
+          loaded.Deserialize(file);
+        } catch (...) {
+          fclose(file);
+          throw;
+        }
+        fclose(file);
+      }
+    } catch (const std::runtime_error &error) {
+      threw = std::string_view(error.what()) ==
+              "Corrupt compressed block...stopped";
+    }
+    assert(threw);
+  }
+  std::cout << "TestBlockCompression passed" << std::endl;
+}
+
+void TestDictionaryEncoding() {
+  // A handful of distinct payloads repeated across many nodes.
+  List list;
+  for (int i = 0; i < 6000; i++) {
+    list.AddNode(i % 100 == 0 ? std::string()
+                              : "tenant-" + std::to_string(i % 9) +
+                                    "/status-" + std::to_string(200 + i % 4));
+    list.SetRand(i, (i * 17) % 6000);
+  }
+  {
+    FILE *file = fopen("temp_dict_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  SerializeOptions plain;
+  plain.format = Format::Columnar;
+  {
+    FILE *file = fopen("temp_dict_plain.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, plain);
+    fclose(file);
+  }
+  size_t plainSize = ReadFileBytes("temp_dict_plain.dat").size();
+
+  for (bool varint : {false, true}) {
+    for (uint32_t chunkNodes : {500u, 0u}) {
+      SerializeOptions options;
+      options.format = Format::Columnar;
+      options.dictionary = true;
+      options.varint = varint;
+      options.chunkNodes = chunkNodes;
+      {
+        FILE *file = fopen("temp_dict.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        list.Serialize(file, options);
+        fclose(file);
+      }
+      assert(ReadFileBytes("temp_dict.dat").size() < plainSize / 2);
+
+      DeserializeOptions loadOptions;
+      loadOptions.threads = 2;
+      List fromFile;
+      {
+        FILE *file = fopen("temp_dict.dat", "rb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for reading");
+        }
+        fromFile.Deserialize(file, loadOptions);
+        fclose(file);
+      }
+      List fromMapping;
+      fromMapping.Deserialize(std::string("temp_dict.dat"), loadOptions);
+
+      for (List *loaded : {&fromFile, &fromMapping}) {
+        assert(loaded->GetCount() == 6000);
+        FILE *file = fopen("temp_dict_again.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        loaded->Serialize(file);
+        fclose(file);
+        assert(ReadFileBytes("temp_dict_again.dat") ==
+               ReadFileBytes("temp_dict_ref.dat"));
+      }
+    }
+  }
+
+  // Inside a compressed container, FILE* reads the dictionary as it streams.
+  SerializeOptions compressed;
+  compressed.format = Format::Columnar;
+  compressed.dictionary = true;
+  compressed.compressBlockSize = 4096;
+  {
+    FILE *file = fopen("temp_dict.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, compressed);
+    fclose(file);
+  }
+  List fromCompressed;
+  {
+    FILE *file = fopen("temp_dict.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    fromCompressed.Deserialize(file);
+    fclose(file);
+  }
+  {
+    FILE *file = fopen("temp_dict_again.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    fromCompressed.Serialize(file);
+    fclose(file);
+  }
+  assert(ReadFileBytes("temp_dict_again.dat") ==
+         ReadFileBytes("temp_dict_ref.dat"));
+  std::cout << "TestDictionaryEncoding passed" << std::endl;
+}
+
+void TestLazyPayloads() {
+  List list;
+  for (int i = 0; i < 2000; i++) {
+    list.AddNode(i % 50 == 0 ? std::string()
+                             : "a payload longer than SSO #" +
+                                   std::to_string(i % 300));
+    list.SetRand(i, (i * 29) % 2000);
+  }
+  {
+    FILE *file = fopen("temp_lazy_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file);
+    fclose(file);
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions dictionary = columnar;
+  dictionary.dictionary = true;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 4096;
+  DeserializeOptions lazy;
+  lazy.payloads = PayloadMode::Lazy;
+  lazy.threads = 2;
+
+  for (const SerializeOptions &options :
+       {SerializeOptions(), columnar, dictionary, compressed}) {
+    {
+      FILE *file = fopen("temp_lazy.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    List fromFile;
+    {
+      FILE *file = fopen("temp_lazy.dat", "rb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for reading");
+      }
+      fromFile.Deserialize(file, lazy);
+      fclose(file);
+    }
+    List fromMapping;
+    fromMapping.Deserialize(std::string("temp_lazy.dat"), lazy);
+
+    // Views keep working after the file is gone; copies survive the List
+    // letting go of the mapping.
+    remove("temp_lazy.dat");
+    for (bool materialize : {false, true}) {
+      for (List *loaded : {&fromFile, &fromMapping}) {
+        if (materialize) {
+          loaded->MaterializePayloads();
+        }
+        // Mapped lazy nodes hold their payload in shared, not data.
+        const ListNode *node = loaded->GetNode(1);
+        assert(node->Payload() == "a payload longer than SSO #1");
+        assert(loaded != &fromMapping || node->data.empty() != materialize);
+        FILE *file = fopen("temp_lazy_again.dat", "wb");
+        if (!file) {
+          throw std::runtime_error("Can't open file for writing");
+        }
+        loaded->Serialize(file);
+        fclose(file);
+        assert(ReadFileBytes("temp_lazy_again.dat") ==
+               ReadFileBytes("temp_lazy_ref.dat"));
+      }
+    }
+  }
+  std::cout << "TestLazyPayloads passed" << std::endl;
+}
+
+void TestRandomAccess() {
+  const int n = 5000;
+  auto expectedData = [](size_t i) {
+    return i % 40 == 0 ? std::string() : "Node" + std::to_string(i % 700);
+  };
+  auto expectedRand = [](size_t i) {
+    return i % 3 == 0 ? -1 : static_cast<int32_t>((i * 7) % n);
+  };
+  List list;
+  for (int i = 0; i < n; i++) {
+    list.AddNode(expectedData(i));
+  }
+  for (int i = 0; i < n; i++) {
+    if (expectedRand(i) >= 0) {
+      list.SetRand(i, expectedRand(i));
+    }
+  }
+
+  SerializeOptions indexed;
+  indexed.indexStride = 100;
+  SerializeOptions indexedParallel = indexed;
+  indexedParallel.threads = 3;
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  columnar.chunkNodes = 64;
+  SerializeOptions packed = columnar;
+  packed.varint = true;
+  packed.randDelta = true;
+  SerializeOptions noTable = packed;
+  noTable.chunkNodes = 0;
+  SerializeOptions dictionary = columnar;
+  dictionary.dictionary = true;
+
+  for (const SerializeOptions &options :
+       {SerializeOptions(), indexed, indexedParallel, columnar, packed,
+        noTable, dictionary}) {
+    {
+      FILE *file = fopen("temp_random.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    SerializedListReader reader("temp_random.dat");
+    assert(reader.GetCount() == n);
+    for (size_t i : {0, 1, 99, 100, 101, 2047, 4000, 4999}) {
+      NodeRecord record = reader.Read(i);
+      assert(record.data == expectedData(i) && record.rand == expectedRand(i));
+    }
+    std::vector<NodeRecord> range = reader.ReadRange(4990, 50);
+    assert(range.size() == 10);
+    for (size_t k = 0; k < range.size(); k++) {
+      assert(range[k].data == expectedData(4990 + k) &&
+             range[k].rand == expectedRand(4990 + k));
+    }
+    bool threw = false;
+    try {
+      reader.Read(n);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+
+    // The footer doesn't get in the way of a full load.
+    List loaded;
+    loaded.Deserialize(std::string("temp_random.dat"));
+    assert(loaded.GetCount() == n);
+  }
+  std::cout << "TestRandomAccess passed" << std::endl;
+}
+
+void TestStreamingRead() {
+  const int n = 3000;
+  auto expectedData = [](size_t i) {
+    return i % 500 == 7 ? std::string(300, 'L')
+                        : "Node" + std::to_string(i % 400);
+  };
+  auto expectedRand = [](size_t i) {
+    return i % 4 == 0 ? -1 : static_cast<int32_t>((i * 11) % n);
+  };
+  List list;
+  for (int i = 0; i < n; i++) {
+    list.AddNode(expectedData(i));
+  }
+  for (int i = 0; i < n; i++) {
+    if (expectedRand(i) >= 0) {
+      list.SetRand(i, expectedRand(i));
+    }
+  }
+
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 1000;
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions packed = columnar;
+  packed.varint = true;
+  packed.randDelta = true;
+  packed.dictionary = true;
+  packed.chunkNodes = 0;
+
+  for (const SerializeOptions &options :
+       {SerializeOptions(), compressed, columnar, packed}) {
+    // The stream must stop at the end of the first list.
+    FILE *file = fopen("temp_stream.dat", "wb+");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, options);
+    list.Serialize(file, options);
+    rewind(file);
+
+    NodeStream stream(file, 64); // smaller than the long payloads
+    assert(stream.GetCount() == n);
+    NodeRecord record;
+    size_t index = 0;
+    while (stream.Next(record)) {
+      assert(record.data == expectedData(index) &&
+             record.rand == expectedRand(index));
+      index++;
+    }
+    assert(index == n);
+
+    List second;
+    second.Deserialize(file);
+    fclose(file);
+    assert(second.GetCount() == n);
+  }
+  std::cout << "TestStreamingRead passed" << std::endl;
+}
+
+void TestSkeletonLoad() {
+  const int n = 2000;
+  List list;
+  List skeleton; // same structure, empty payloads
+  for (int i = 0; i < n; i++) {
+    list.AddNode(std::string(100 + i % 50, 'p'));
+    skeleton.AddNode("");
+  }
+  std::vector<int32_t> expected(n, -1);
+  for (int i = 0; i < n; i += 2) {
+    expected[i] = (i * 13 + 5) % n;
+    list.SetRand(i, expected[i]);
+    skeleton.SetRand(i, expected[i]);
+  }
+  {
+    FILE *file = fopen("temp_skeleton_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    skeleton.Serialize(file);
+    fclose(file);
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  columnar.varint = true;
+  SerializeOptions dictionary = columnar;
+  dictionary.dictionary = true;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 4096;
+  DeserializeOptions skip;
+  skip.payloads = PayloadMode::Skip;
+
+  for (const SerializeOptions &options :
+       {SerializeOptions(), columnar, dictionary, compressed}) {
+    {
+      FILE *file = fopen("temp_skeleton.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    assert(List::ReadRandIndices("temp_skeleton.dat") == expected);
+
+    List fromFile;
+    {
+      FILE *file = fopen("temp_skeleton.dat", "rb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for reading");
+      }
+      fromFile.Deserialize(file, skip);
+      fclose(file);
+    }
+    List fromMapping;
+    fromMapping.Deserialize(std::string("temp_skeleton.dat"), skip);
+
+    for (List *loaded : {&fromFile, &fromMapping}) {
+      FILE *file = fopen("temp_skeleton_again.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      loaded->Serialize(file);
+      fclose(file);
+      assert(ReadFileBytes("temp_skeleton_again.dat") ==
+             ReadFileBytes("temp_skeleton_ref.dat"));
+    }
+  }
+
+  // Large payloads are seeked past node by node, small ones read through;
+  // either way the file is left at the next list.
+  List big;
+  List bigSkeleton;
+  for (int i = 0; i < 200; i++) {
+    big.AddNode(std::string(kSkipSeekMinPayload + i, 'b'));
+    bigSkeleton.AddNode("");
+  }
+  for (int i = 0; i < 200; i++) {
+    if (expected[i] >= 0) {
+      big.SetRand(i, expected[i] % 200);
+      bigSkeleton.SetRand(i, expected[i] % 200);
+    }
+  }
+  for (auto [source, reference] :
+       {std::pair(&list, &skeleton), std::pair(&big, &bigSkeleton)}) {
+    {
+      FILE *file = fopen("temp_skeleton.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      source->Serialize(file);
+      source->Serialize(file);
+      fclose(file);
+      file = fopen("temp_skeleton_ref.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      reference->Serialize(file);
+      fclose(file);
+    }
+    FILE *file = fopen("temp_skeleton.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    for (int copy = 0; copy < 2; copy++) {
+      List loaded;
+      loaded.Deserialize(file, skip);
+      FILE *again = fopen("temp_skeleton_again.dat", "wb");
+      if (!again) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      loaded.Serialize(again);
+      fclose(again);
+      assert(ReadFileBytes("temp_skeleton_again.dat") ==
+             ReadFileBytes("temp_skeleton_ref.dat"));
+    }
+    assert(fgetc(file) == EOF);
+    fclose(file);
+  }
+  std::cout << "TestSkeletonLoad passed" << std::endl;
+}
+
+void TestFilteredDeserialize() {
+  // Keep every tenth node by payload; rand pointers all land on kept nodes.
+  const int n = 1000;
+  List list;
+  for (int i = 0; i < n; i++) {
+    list.AddNode("Node" + std::to_string(i));
+  }
+  for (int i = 0; i < n; i++) {
+    list.SetRand(i, (i * 10) % n);
+  }
+  List expected;
+  for (int k = 0; k < n / 10; k++) {
+    expected.AddNode("Node" + std::to_string(k * 10));
+  }
+  for (int k = 0; k < n / 10; k++) {
+    expected.SetRand(k, (k * 100) % n / 10);
+  }
+  {
+    FILE *file = fopen("temp_filter_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    expected.Serialize(file);
+    fclose(file);
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  for (const SerializeOptions &options : {SerializeOptions(), columnar}) {
+    {
+      FILE *file = fopen("temp_filter.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    List filtered;
+    {
+      FILE *file = fopen("temp_filter.dat", "rb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for reading");
+      }
+      filtered.DeserializeFiltered(
+          file, [](size_t, std::string_view data) {
+            return data.back() == '0';
+          });
+      fclose(file);
+    }
+    assert(filtered.GetCount() == n / 10);
+    FILE *file = fopen("temp_filter_again.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    filtered.Serialize(file);
+    fclose(file);
+    assert(ReadFileBytes("temp_filter_again.dat") ==
+           ReadFileBytes("temp_filter_ref.dat"));
+  }
+
+  // A chain i -> i + 1 keeping every third node. Null drops every rand
+  // pointer, Follow skips over the dropped links; 28 and 29 form a loop.
+  List chain;
+  for (int i = 0; i < 30; i++) {
+    chain.AddNode(std::to_string(i));
+  }
+  for (int i = 0; i < 29; i++) {
+    chain.SetRand(i, i + 1);
+  }
+  chain.SetRand(29, 28);
+  {
+    FILE *file = fopen("temp_filter.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    chain.Serialize(file);
+    fclose(file);
+  }
+  for (DroppedRand policy : {DroppedRand::Null, DroppedRand::Follow}) {
+    List filtered;
+    FILE *file = fopen("temp_filter.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    filtered.DeserializeFiltered(
+        file, [](size_t index, std::string_view) { return index % 3 == 0; },
+        policy);
+    fclose(file);
+    assert(filtered.GetCount() == 10);
+
+    List expectedChain;
+    for (int k = 0; k < 10; k++) {
+      expectedChain.AddNode(std::to_string(k * 3));
+    }
+    for (int k = 0; k < 9 && policy == DroppedRand::Follow; k++) {
+      expectedChain.SetRand(k, k + 1);
+    }
+    for (List *target : {&filtered, &expectedChain}) {
+      FILE *out = fopen(target == &filtered ? "temp_filter_again.dat"
+                                            : "temp_filter_ref.dat",
+                        "wb");
+      if (!out) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      target->Serialize(out);
+      fclose(out);
+    }
+    assert(ReadFileBytes("temp_filter_again.dat") ==
+           ReadFileBytes("temp_filter_ref.dat"));
+  }
+  std::cout << "TestFilteredDeserialize passed" << std::endl;
+}
+
+void TestSinksAndSources() {
+  List list;
+  for (int i = 0; i < 500; i++) {
+    list.AddNode("Node" + std::to_string(i % 37));
+  }
+  for (int i = 0; i < 500; i += 3) {
+    list.SetRand(i, (i * 7) % 500);
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  columnar.varint = true;
+  columnar.randDelta = true;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 512;
+  SerializeOptions indexed;
+  indexed.indexStride = 64;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), columnar, compressed, indexed}) {
+    {
+      FILE *file = fopen("temp_sink.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    std::vector<char> expected = ReadFileBytes("temp_sink.dat");
+
+    std::vector<char> memory;
+    MemorySink memorySink(memory);
+    list.Serialize(memorySink, options);
+    assert(memory == expected);
+
+    CountingSink counter;
+    list.Serialize(counter, options);
+    assert(counter.GetCount() == expected.size());
+
+    std::vector<char> region(expected.size());
+    SpanSink spanSink(region.data(), region.size());
+    list.Serialize(spanSink, options);
+    assert(region == expected);
+
+    // One byte short must fail like a full disk.
+    SpanSink shortSink(region.data(), region.size() - 1);
+    bool threw = false;
+    try {
+      list.Serialize(shortSink, options);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+
+    // Through a pipe, which neither side can seek or map. Reading stops at
+    // the end of the list: an index footer and whatever follows it are left
+    // for the next reader.
+    int fds[2];
+    if (pipe(fds) != 0) {
+      throw std::runtime_error("Can't open pipe");
+    }
+    const std::string trailer = "next message";
+    std::thread writer([&] {
+      FdSink fdSink(fds[1]);
+      list.Serialize(fdSink, options);
+      list.Serialize(fdSink, options);
+      fdSink.Write(trailer.data(), trailer.size());
+      close(fds[1]);
+    });
+    FdSource source(fds[0]);
+    DeserializeOptions lazy;
+    lazy.payloads = PayloadMode::Lazy;
+    SerializeOptions bare = options;
+    bare.indexStride = 0;
+    CountingSink bareCounter;
+    list.Serialize(bareCounter, bare);
+    size_t footerSize = expected.size() - bareCounter.GetCount();
+    std::vector<char> rest;
+    for (int copy = 0; copy < 2; copy++) {
+      List piped;
+      piped.Deserialize(source, lazy);
+      std::vector<char> again;
+      MemorySink againSink(again);
+      piped.Serialize(againSink, options);
+      assert(again == expected);
+      rest.resize(footerSize);
+      size_t got = 0;
+      while (got < footerSize) {
+        size_t chunk = source.Read(rest.data() + got, footerSize - got);
+        if (chunk == 0) {
+          break;
+        }
+        got += chunk;
+      }
+      assert(got == footerSize && std::equal(rest.begin(), rest.end(),
+                                             expected.end() - footerSize));
+    }
+    rest.assign(trailer.size() + 1, '\0');
+    size_t got = 0;
+    while (size_t chunk = source.Read(rest.data() + got, rest.size() - got)) {
+      got += chunk;
+    }
+    writer.join();
+    close(fds[0]);
+    assert(std::string_view(rest.data(), got) == trailer);
+  }
+  std::cout << "TestSinksAndSources passed" << std::endl;
+}
+
+void TestMemoryBuffers() {
+  List list;
+  for (int i = 0; i < 400; i++) {
+    list.AddNode(std::string(i % 5, 'a' + i % 26));
+  }
+  for (int i = 0; i < 400; i += 2) {
+    list.SetRand(i, 399 - i);
+  }
+
+  SerializeOptions dictionary;
+  dictionary.format = Format::Columnar;
+  dictionary.dictionary = true;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 256;
+  SerializeOptions indexed;
+  indexed.indexStride = 16;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), dictionary, compressed, indexed}) {
+    {
+      FILE *file = fopen("temp_buffer.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    std::vector<char> expected = ReadFileBytes("temp_buffer.dat");
+    std::vector<std::byte> bytes = list.SerializeToBuffer(options);
+    assert(bytes.size() == expected.size() &&
+           memcmp(bytes.data(), expected.data(), bytes.size()) == 0);
+    if (options.compressBlockSize == 0) {
+      assert(bytes.capacity() == bytes.size()); // presized, never regrown
+    }
+
+    for (PayloadMode mode : {PayloadMode::Copy, PayloadMode::Lazy}) {
+      DeserializeOptions load;
+      load.payloads = mode;
+      List loaded;
+      loaded.DeserializeFrom(bytes, load);
+      loaded.MaterializePayloads();
+      assert(loaded.SerializeToBuffer(options) == bytes);
+    }
+  }
+
+  List empty;
+  empty.DeserializeFrom(List().SerializeToBuffer());
+  assert(empty.GetCount() == 0);
+  std::cout << "TestMemoryBuffers passed" << std::endl;
+}
+
+void TestGatheredWrites() {
+  // Large payloads among small ones, more than one gather list per flush.
+  List list;
+  for (int i = 0; i < 3000; i++) {
+    list.AddNode(i % 2 ? std::string(1000 + i, 'a' + i % 26)
+                       : "Node" + std::to_string(i));
+  }
+  for (int i = 0; i < 3000; i += 7) {
+    list.SetRand(i, (i * 13) % 3000);
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions dictionary = columnar;
+  dictionary.dictionary = true;
+  SerializeOptions parallel = columnar;
+  parallel.threads = 3;
+  parallel.chunkNodes = 500;
+  SerializeOptions indexed;
+  indexed.indexStride = 100;
+  SerializeOptions small; // flushes between the gathered pieces too
+  small.bufferSize = 64;
+  for (SerializeOptions options :
+       {SerializeOptions(), columnar, dictionary, parallel, indexed, small}) {
+    for (size_t threshold : {size_t{0}, size_t{1024}}) {
+      options.gatherThreshold = threshold;
+      // Twice into one file: the FILE* must end up after the first list.
+      FILE *file = fopen(threshold ? "temp_gather.dat" : "temp_gather_ref.dat",
+                         "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fputc('|', file);
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    assert(ReadFileBytes("temp_gather.dat") ==
+           ReadFileBytes("temp_gather_ref.dat"));
+  }
+
+  // A pipe, where writev returns after whatever fits.
+  std::vector<char> expected = ReadFileBytes("temp_gather_ref.dat");
+  expected.resize(expected.size() / 2);
+  int fds[2];
+  if (pipe(fds) != 0) {
+    throw std::runtime_error("Can't open pipe");
+  }
+  std::thread writer([&] {
+    FdSink sink(fds[1]);
+    SerializeOptions options;
+    options.gatherThreshold = 1024;
+    options.bufferSize = 64;
+    list.Serialize(sink, options);
+    close(fds[1]);
+  });
+  std::vector<char> received;
+  char chunk[4096];
+  ssize_t got = 0;
+  while ((got = read(fds[0], chunk, sizeof(chunk))) > 0) {
+    received.insert(received.end(), chunk, chunk + got);
+  }
+  writer.join();
+  close(fds[0]);
+  assert(received == expected);
+  std::cout << "TestGatheredWrites passed" << std::endl;
+}
+
+void TestAsyncSerialize() {
+  List list;
+  for (int i = 0; i < 2000; i++) {
+    list.AddNode("Node" + std::to_string(i) + std::string(i % 50, '.'));
+  }
+  for (int i = 0; i < 2000; i += 3) {
+    list.SetRand(i, (i * 17) % 2000);
+  }
+
+  SerializeOptions small; // many blocks through both buffers
+  small.bufferSize = 100;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 1000;
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  columnar.varint = true;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), small, compressed, columnar}) {
+    {
+      FILE *file = fopen("temp_async_ref.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    FILE *file = fopen("temp_async.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    std::future<void> written = list.SerializeAsync(file, options);
+    // Everything is encoded by now, changing the list is fine.
+    list.AddNode("after");
+    written.get();
+    fclose(file);
+    assert(ReadFileBytes("temp_async.dat") ==
+           ReadFileBytes("temp_async_ref.dat"));
+  }
+
+  // A file open for reading fails either while encoding or in the future.
+  FILE *file = fopen("temp_async.dat", "rb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for reading");
+  }
+  bool threw = false;
+  try {
+    list.SerializeAsync(file, small).get();
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  fclose(file);
+  assert(threw);
+  std::cout << "TestAsyncSerialize passed" << std::endl;
+}
+
+// Every node must sit at its walk position in the positional index.
+void CheckPositions(const List &list) {
+  int index = 0;
+  for (ListNode *node = list.GetNode(0); node; node = node->next) {
+    assert(list.GetNode(index) == node);
+    assert(node->index == static_cast<uint32_t>(index));
+    index++;
+  }
+  assert(index == list.GetCount());
+  assert(!list.GetNode(-1) && !list.GetNode(list.GetCount()));
+}
+
+void TestPositionalAccess() {
+  // 100000 SetRand calls, two full walks each before the index.
+  const int n = 100000;
+  List list;
+  for (int i = 0; i < n; i++) {
+    list.AddNode(std::to_string(i));
+  }
+  uint32_t state = 12345;
+  std::vector<int> expected(n, -1);
+  for (int i = 0; i < n; i++) {
+    state = state * 1103515245 + 12345;
+    int from = static_cast<int>(state % n);
+    state = state * 1103515245 + 12345;
+    int to = static_cast<int>(state % n);
+    list.SetRand(from, to);
+    expected[from] = to;
+  }
+  CheckPositions(list);
+  for (int i = 0; i < n; i++) {
+    ListNode *rand = list.GetNode(i)->rand;
+    assert(rand == (expected[i] < 0 ? nullptr : list.GetNode(expected[i])));
+  }
+
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  for (const SerializeOptions &options : {SerializeOptions(), columnar}) {
+    {
+      FILE *file = fopen("temp_positions.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      list.Serialize(file, options);
+      fclose(file);
+    }
+    List fromFile;
+    FILE *file = fopen("temp_positions.dat", "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for reading");
+    }
+    fromFile.Deserialize(file);
+    CheckPositions(fromFile);
+    // New nodes and rand pointers go on after a load.
+    fromFile.AddNode("extra");
+    fromFile.SetRand(n, 0);
+    assert(fromFile.GetNode(n)->rand == fromFile.GetNode(0));
+    CheckPositions(fromFile);
+
+    List fromMapping;
+    fromMapping.Deserialize(std::string("temp_positions.dat"));
+    CheckPositions(fromMapping);
+
+    rewind(file);
+    List filtered;
+    filtered.DeserializeFiltered(
+        file, [](size_t index, std::string_view) { return index % 2; });
+    fclose(file);
+    assert(filtered.GetCount() == n / 2);
+    CheckPositions(filtered);
   }
 
-  std::vector<ListNode *> nodes;
-  ListNode *node = head;
-  while (node) {
-    nodes.push_back(node);
-    node = node->next;
-  }
+  list.Clear();
+  CheckPositions(list);
+  std::cout << "TestPositionalAccess passed" << std::endl;
+}
 
-  std::unordered_map<ListNode *, int32_t> nodeToIndex;
-  for (size_t i = 0; i < nodes.size(); i++) {
-    nodeToIndex[nodes[i]] = static_cast<int32_t>(i);
+void TestSetRandBatch() {
+  const int n = 5000;
+  std::vector<int32_t> rands(n);
+  for (int i = 0; i < n; i++) {
+    rands[i] = i % 5 == 0 ? -1 : (i * 31) % n;
   }
+  rands[1] = n; // outside the list, nullptr like -1
 
-  for (ListNode *node : nodes) {
-    uint32_t dataSize = static_cast<uint32_t>(node->data.size());
-    if (fwrite(&dataSize, sizeof(dataSize), 1, file) != 1) {
-      throw std::runtime_error("Error writing data size...stopped");
+  List expected;
+  for (int i = 0; i < n; i++) {
+    expected.AddNode(std::to_string(i));
+  }
+  for (int i = 0; i < n; i++) {
+    if (rands[i] >= 0 && rands[i] < n) {
+      expected.SetRand(i, rands[i]);
+    }
+  }
+  {
+    FILE *file = fopen("temp_batch_ref.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
     }
+    expected.Serialize(file);
+    fclose(file);
+  }
 
-    if (dataSize > 0) {
-      if (fwrite(node->data.data(), 1, dataSize, file) != dataSize) {
-        throw std::runtime_error("Error writing data...stopped");
-      }
+  for (unsigned threads : {1u, 3u}) {
+    List list;
+    for (int i = 0; i < n; i++) {
+      list.AddNode(std::to_string(i));
+    }
+    list.SetRand(7, 8); // replaced by the batch
+    list.SetRandBatch(rands, threads);
+    FILE *file = fopen("temp_batch.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
     }
+    list.Serialize(file);
+    fclose(file);
+    assert(ReadFileBytes("temp_batch.dat") ==
+           ReadFileBytes("temp_batch_ref.dat"));
 
-    int32_t randIndex = -1;
-    if (node->rand != nullptr) {
-      randIndex = nodeToIndex[node->rand];
+    // What ReadRandIndices returns goes straight back in.
+    List copy;
+    for (int i = 0; i < n; i++) {
+      copy.AddNode(std::to_string(i));
     }
-    if (fwrite(&randIndex, sizeof(randIndex), 1, file) != 1) {
-      throw std::runtime_error("Error writing rand index...stopped");
+    copy.SetRandBatch(List::ReadRandIndices("temp_batch.dat"), threads);
+    file = fopen("temp_batch.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
     }
+    copy.Serialize(file);
+    fclose(file);
+    assert(ReadFileBytes("temp_batch.dat") ==
+           ReadFileBytes("temp_batch_ref.dat"));
   }
-}
 
-uint32_t List::readUint32(FILE *file) {
-  uint32_t value = 0;
-  if (fread(&value, sizeof(value), 1, file) != 1) {
-    throw std::runtime_error("Error reading uint32_t value...stopped");
+  bool threw = false;
+  try {
+    expected.SetRandBatch(std::span<const int32_t>(rands).first(n - 1));
+  } catch (const std::runtime_error &) {
+    threw = true;
   }
-  return value;
+  assert(threw);
+  std::cout << "TestSetRandBatch passed" << std::endl;
 }
 
-std::unique_ptr<ListNode> List::readNode(FILE *file, int32_t &outRandIndex) {
-  auto node = std::make_unique<ListNode>();
-  uint32_t dataSize = readUint32(file);
-
-  if (dataSize > 0) {
-    std::string str;
-    str.resize(dataSize);
-    if (fread(&str[0], 1, dataSize, file) != dataSize) {
-      throw std::runtime_error("Error reading node data...stopped");
+void TestFromRange() {
+  const int n = 1000;
+  std::vector<std::string> payloads;
+  std::vector<int32_t> rands;
+  List expected;
+  for (int i = 0; i < n; i++) {
+    payloads.push_back("A payload too long for SSO, number " +
+                       std::to_string(i));
+    rands.push_back(i % 3 ? (i * 7) % n : -1);
+    expected.AddNode(payloads.back());
+  }
+  for (int i = 0; i < n; i++) {
+    if (rands[i] >= 0) {
+      expected.SetRand(i, rands[i]);
     }
-    node->data = std::move(str);
   }
+  std::vector<std::byte> reference = expected.SerializeToBuffer();
 
-  if (fread(&outRandIndex, sizeof(outRandIndex), 1, file) != 1) {
-    throw std::runtime_error("Error reading rand index...stopped");
+  // Copied from an lvalue range, from views, then moved.
+  List copied = List::FromRange(payloads, rands);
+  assert(copied.SerializeToBuffer() == reference);
+  assert(payloads[5] == expected.GetNode(5)->data);
+
+  std::vector<std::string_view> views(payloads.begin(), payloads.end());
+  assert(List::FromRange(views, rands).SerializeToBuffer() == reference);
+
+  std::vector<const char *> pointers;
+  for (const std::string &payload : payloads) {
+    pointers.push_back(payload.c_str());
   }
+  assert(List::FromRange(pointers, rands).SerializeToBuffer() == reference);
 
-  return node;
-}
+  // Temporary views still refer to the caller's strings: copy, not move.
+  std::vector<std::string> before = payloads;
+  assert(List::FromRange(std::span<std::string>(payloads), rands)
+             .SerializeToBuffer() == reference);
+  assert(List::FromRange(std::views::all(payloads), rands)
+             .SerializeToBuffer() == reference);
+  assert(List::FromRange(payloads | std::views::take(1)).GetNode(0)->data ==
+         before[0]);
+  assert(payloads == before);
 
-void List::setupLinks(const std::vector<ListNode *> &nodes) {
-  size_t n = nodes.size();
-  for (size_t i = 0; i < n; i++) {
-    if (i > 0) {
-      nodes[i]->prev = nodes[i - 1];
-    } else {
-      nodes[i]->prev = nullptr;
-    }
+  const char *storage = payloads[9].data();
+  List moved = List::FromRange(std::move(payloads), rands);
+  assert(moved.SerializeToBuffer() == reference);
+  assert(moved.GetNode(9)->data.data() == storage); // not copied
 
-    if (i < n - 1) {
-      nodes[i]->next = nodes[i + 1];
-    } else {
-      nodes[i]->next = nullptr;
-    }
+  // Without rand indices, and from a view of prvalue strings.
+  List numbers = List::FromRange(std::views::iota(0, 10) |
+                                 std::views::transform([](int i) {
+                                   return std::to_string(i);
+                                 }));
+  assert(numbers.GetCount() == 10 && numbers.GetNode(9)->data == "9" &&
+         !numbers.GetNode(0)->rand && !numbers.GetNode(9)->next);
+  assert(List::FromRange(std::vector<std::string>()).GetCount() == 0);
+
+  bool threw = false;
+  try {
+    List::FromRange(views, std::span<const int32_t>(rands).first(2));
+  } catch (const std::runtime_error &) {
+    threw = true;
   }
+  assert(threw);
+
+  // Moves hand the nodes over and leave a usable empty list.
+  List target = std::move(moved);
+  assert(target.SerializeToBuffer() == reference && moved.GetCount() == 0);
+  moved.AddNode("again");
+  assert(moved.GetCount() == 1 && moved.GetNode(0)->data == "again");
+  target = std::move(copied);
+  assert(target.SerializeToBuffer() == reference && copied.GetCount() == 0);
+  std::cout << "TestFromRange passed" << std::endl;
 }
 
-void List::setupRandPointers(const std::vector<ListNode *> &nodes,
-                             const std::vector<int32_t> &randIndices) {
-  size_t n = nodes.size();
-  for (size_t i = 0; i < n; i++) {
-    int32_t randomIndex = randIndices[i];
-    if (randomIndex >= 0 && static_cast<size_t>(randomIndex) < n) {
-      nodes[i]->rand = nodes[randomIndex];
-    } else {
-      nodes[i]->rand = nullptr;
+void TestAddNodeAllocations() {
+  // Payloads too long for SSO, so each string buffer is one allocation.
+  const int n = 1000;
+  const std::string longText(100, 'p');
+  std::vector<std::string> owned(n, longText);
+
+  // Allocations for n AddNode calls through add, less those of the list
+  // structure (arena blocks, positional index), which an empty payload
+  // measures.
+  auto allocationsPerNode = [&](const auto &add) {
+    auto count = [&](const auto &addOne) {
+      List list;
+      size_t before = allocationCount;
+      for (int i = 0; i < n; i++) {
+        addOne(list, i);
+      }
+      return allocationCount - before;
+    };
+    size_t structure =
+        count([](List &list, int) { list.AddNode(std::string()); });
+    return (count(add) - structure) / static_cast<double>(n);
+  };
+
+  assert(allocationsPerNode([&](List &list, int) {
+           list.AddNode(longText);
+         }) == 1);
+  assert(allocationsPerNode([&](List &list, int i) {
+           list.AddNode(std::move(owned[i]));
+         }) == 0);
+  assert(allocationsPerNode([&](List &list, int) {
+           list.AddNode(std::string_view(longText));
+         }) == 1);
+  assert(allocationsPerNode([&](List &list, int) {
+           list.AddNode(longText.c_str());
+         }) == 1);
+  // A temporary used to be built and then copied: two allocations.
+  assert(allocationsPerNode([&](List &list, int) {
+           list.AddNode(std::string(100, 't'));
+         }) == 1);
+  assert(allocationsPerNode([](List &list, int) {
+           list.EmplaceNode(100, 'e');
+         }) == 1);
+  assert(allocationsPerNode([&](List &list, int) {
+           list.EmplaceNode(longText.begin(), longText.end());
+         }) == 1);
+
+  List list;
+  list.AddNode("literal");
+  list.EmplaceNode(3, 'x');
+  list.AddNode(std::string_view("view"));
+  assert(list.GetNode(0)->data == "literal" && list.GetNode(1)->data == "xxx" &&
+         list.GetNode(2)->data == "view");
+  std::cout << "TestAddNodeAllocations passed" << std::endl;
+}
+
+void TestIndexedList() {
+  const int n = 3000;
+  List list;
+  IndexedList indexed;
+  for (int i = 0; i < n; i++) {
+    std::string data = i % 100 == 0 ? std::string(200, 'L')
+                                    : "Node" + std::to_string(i % 300);
+    list.AddNode(data);
+    indexed.AddNode(data);
+  }
+  std::vector<int32_t> rands(n);
+  for (int i = 0; i < n; i++) {
+    rands[i] = i % 4 ? (i * 19) % n : -1;
+  }
+  list.SetRandBatch(rands);
+  indexed.SetRandBatch(rands);
+  indexed.SetRand(0, 1);
+  list.SetRand(0, 1);
+  assert(indexed.GetCount() == n && indexed.GetRand(0) == 1 &&
+         indexed.GetRand(4) == -1 && indexed.GetData(5) == "Node5");
+
+  // Same bytes as List in every format both write.
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions untabled = columnar;
+  untabled.chunkNodes = 0;
+  SerializeOptions chunked = columnar;
+  chunked.chunkNodes = 1000;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), columnar, untabled, chunked}) {
+    std::vector<char> fromList;
+    MemorySink listSink(fromList);
+    list.Serialize(listSink, options);
+    std::vector<char> fromIndexed;
+    MemorySink indexedSink(fromIndexed);
+    indexed.Serialize(indexedSink, options);
+    assert(fromIndexed == fromList);
+    std::vector<std::byte> buffer = indexed.SerializeToBuffer(options);
+    assert(buffer.size() == fromList.size() &&
+           memcmp(buffer.data(), fromList.data(), buffer.size()) == 0);
+  }
+
+  // Loads what List writes, encodings included, and writes it back plain.
+  std::vector<char> expected;
+  MemorySink expectedSink(expected);
+  list.Serialize(expectedSink);
+  SerializeOptions packed = columnar;
+  packed.varint = true;
+  packed.randDelta = true;
+  packed.dictionary = true;
+  SerializeOptions compressed;
+  compressed.compressBlockSize = 4096;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), columnar, packed, compressed}) {
+    FILE *file = fopen("temp_indexed.dat", "wb+");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    list.Serialize(file, options);
+    fflush(file);
+    IndexedList fromFd;
+    fromFd.Deserialize(fileno(file));
+    rewind(file);
+    IndexedList fromFile;
+    fromFile.Deserialize(file);
+    fclose(file);
+    IndexedList fromMapping;
+    fromMapping.Deserialize(std::string("temp_indexed.dat"));
+    IndexedList fromBuffer;
+    fromBuffer.DeserializeFrom(list.SerializeToBuffer(options));
+    for (IndexedList *loaded :
+         {&fromFile, &fromFd, &fromMapping, &fromBuffer}) {
+      std::vector<char> again;
+      MemorySink againSink(again);
+      loaded->Serialize(againSink);
+      assert(again == expected);
     }
   }
-}
 
-void List::Deserialize(FILE *file) {
-  Clear();
+  bool threw = false;
+  try {
+    std::vector<char> bytes;
+    MemorySink sink(bytes);
+    indexed.Serialize(sink, packed);
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  assert(threw);
 
-  if (!file) {
-    throw std::runtime_error("File not open for reading...stopped");
+  // A payload copied from the pool itself, while the pool grows.
+  IndexedList self;
+  self.AddNode(std::string(100, 's'));
+  for (int i = 0; i < 20; i++) {
+    self.AddNode(self.GetData(i));
   }
+  assert(self.GetData(20) == std::string(100, 's'));
+  self.Clear();
+  assert(self.GetCount() == 0);
+  std::cout << "TestIndexedList passed" << std::endl;
+}
 
-  uint32_t newCount = readUint32(file);
+// Every columnar section of an empty list is zero bytes long, which must not
+// reach memcpy with the null data() of an empty vector.
+void TestEmptyColumnarList() {
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions untabled = columnar;
+  untabled.chunkNodes = 0;
+  SerializeOptions fixedWidth = columnar;
+  fixedWidth.randDelta = true;
+  fixedWidth.dictionary = true;
+  SerializeOptions packed = fixedWidth;
+  packed.varint = true;
+  SerializeOptions compressed = columnar;
+  compressed.compressBlockSize = 4096;
+  DeserializeOptions lazy;
+  lazy.payloads = PayloadMode::Lazy;
+  DeserializeOptions skip;
+  skip.payloads = PayloadMode::Skip;
 
-  std::vector<std::unique_ptr<ListNode>> tempNodes;
-  tempNodes.reserve(newCount);
-  std::vector<ListNode *> rawNodes;
-  rawNodes.reserve(newCount);
-  std::vector<int32_t> randIndices;
-  randIndices.reserve(newCount);
+  List empty;
+  for (const SerializeOptions &options :
+       {columnar, untabled, fixedWidth, packed, compressed}) {
+    {
+      FILE *file = fopen("temp_empty_columnar.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      empty.Serialize(file, options);
+      fclose(file);
+    }
+    std::vector<std::byte> bytes = empty.SerializeToBuffer(options);
+    for (const DeserializeOptions &load : {DeserializeOptions(), lazy, skip}) {
+      List fromFile;
+      FILE *file = fopen("temp_empty_columnar.dat", "rb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for reading");
+      }
+      fromFile.Deserialize(file, load);
+      rewind(file);
+      List fromSource;
+      FileSource source(file);
+      fromSource.Deserialize(source, load);
+      List fromFd;
+      fromFd.Deserialize(fileno(file), load);
+      fclose(file);
+      List fromMapping;
+      fromMapping.Deserialize(std::string("temp_empty_columnar.dat"), load);
+      List fromBuffer;
+      fromBuffer.DeserializeFrom(bytes, load);
+      for (List *loaded :
+           {&fromFile, &fromSource, &fromFd, &fromMapping, &fromBuffer}) {
+        assert(loaded->GetCount() == 0 && !loaded->GetNode(0));
+      }
+    }
+    assert(List::ReadRandIndices("temp_empty_columnar.dat").empty());
+    if (options.compressBlockSize == 0) {
+      SerializedListReader reader("temp_empty_columnar.dat");
+      assert(reader.GetCount() == 0 && reader.ReadRange(0, 10).empty());
+    }
 
-  for (size_t i = 0; i < newCount; i++) {
-    int32_t randomIndex = -1;
-    auto node = readNode(file, randomIndex);
-    rawNodes.push_back(node.get());
-    tempNodes.push_back(std::move(node));
-    randIndices.push_back(randomIndex);
+    IndexedList indexed;
+    indexed.DeserializeFrom(bytes);
+    assert(indexed.GetCount() == 0);
+    indexed.Deserialize(std::string("temp_empty_columnar.dat"));
+    assert(indexed.GetCount() == 0);
+  }
+
+  // An index footer with no entries.
+  SerializeOptions indexed;
+  indexed.indexStride = 64;
+  {
+    FILE *file = fopen("temp_empty_columnar.dat", "wb");
+    if (!file) {
+      throw std::runtime_error("Can't open file for writing");
+    }
+    empty.Serialize(file, indexed);
+    fclose(file);
   }
+  SerializedListReader reader("temp_empty_columnar.dat");
+  assert(reader.GetCount() == 0 && reader.ReadRange(0, 10).empty());
+  std::cout << "TestEmptyColumnarList passed" << std::endl;
+}
 
-  setupLinks(rawNodes);
-  setupRandPointers(rawNodes, randIndices);
+// -------------------- Benchmarks --------------------
+// Run with --benchmark [nodes] in place of the tests. Timings are the best of
+// three runs; scratch files go to the working directory.
 
-  if (newCount > 0) {
-    head = rawNodes[0];
-    tail = rawNodes[newCount - 1];
-  } else {
-    head = tail = nullptr;
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+template <typename Run> double BestOfThree(const Run &run) {
+  double best = 0;
+  for (int r = 0; r < 3; r++) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    double seconds = SecondsSince(start);
+    best = r == 0 ? seconds : std::min(best, seconds);
   }
-  count = static_cast<int>(newCount);
+  return best;
+}
 
-  for (size_t i = 0; i < newCount; i++) {
-    tempNodes[i].release();
+// The list every benchmark starts from, in the original field-by-field
+// writer's style: three fwrite calls per node. n short payloads ("payload-0"
+// to "payload-999"), every even node's rand pointing at (i * 7919) % n.
+void WriteBenchmarkList(FILE *file, int n) {
+  uint32_t count = static_cast<uint32_t>(n);
+  fwrite(&count, sizeof(count), 1, file);
+  for (int i = 0; i < n; i++) {
+    std::string data = "payload-" + std::to_string(i % 1000);
+    uint32_t dataSize = static_cast<uint32_t>(data.size());
+    int32_t randIndex =
+        i % 2 ? -1 : static_cast<int32_t>((int64_t{i} * 7919) % n);
+    fwrite(&dataSize, sizeof(dataSize), 1, file);
+    fwrite(data.data(), 1, dataSize, file);
+    fwrite(&randIndex, sizeof(randIndex), 1, file);
   }
 }
 
-void List::SetRand(int nodeIndex, int randIndex) {
-  if (nodeIndex < 0 || nodeIndex >= count || randIndex < 0 ||
-      randIndex >= count) {
-    return;
+// Loading the list from a file sets every rand pointer in one pass.
+void LoadBenchmarkList(List &list, int n) {
+  FILE *file = fopen("bench.dat", "wb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for writing");
   }
+  WriteBenchmarkList(file, n);
+  fclose(file);
+  file = fopen("bench.dat", "rb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for reading");
+  }
+  list.Deserialize(file);
+  fclose(file);
+  remove("bench.dat");
+}
 
-  ListNode *node = head;
-  for (size_t i = 0; i < nodeIndex; i++) {
-    node = node->next;
+// Resident set size of this process in KiB, 0 if unknown.
+long ResidentKb() {
+  FILE *status = fopen("/proc/self/status", "r");
+  if (!status) {
+    return 0;
+  }
+  long kb = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), status)) {
+    if (strncmp(line, "VmRSS:", 6) == 0) {
+      kb = strtol(line + 6, nullptr, 10);
+      break;
+    }
   }
+  fclose(status);
+  return kb;
+}
 
-  ListNode *randNode = head;
-  for (size_t i = 0; i < randIndex; i++) {
-    randNode = randNode->next;
+// Runs load in a forked child and reports its time and the RSS the loaded
+// list adds. The child first hands the heap's free pages back to the
+// kernel, so memory freed by earlier runs can't hide part of the load.
+template <typename Load> void ReportLoadInChild(const Load &load) {
+  std::cout.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("Can't fork");
   }
+  if (pid == 0) {
+    int code = 0;
+    try {
+      malloc_trim(0);
+      long before = ResidentKb();
+      auto start = std::chrono::steady_clock::now();
+      List list;
+      load(list);
+      double seconds = SecondsSince(start);
+      std::cout << "load " << seconds << " s, RSS +"
+                << (ResidentKb() - before) / 1024 << " MiB" << std::endl;
+    } catch (const std::exception &ex) {
+      std::cout << "failed: " << ex.what() << std::endl;
+      code = 1;
+    }
+    _exit(code);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+}
 
-  node->rand = randNode;
+void SerializeToPath(List &list, const char *path,
+                     const SerializeOptions &options = SerializeOptions()) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for writing");
+  }
+  list.Serialize(file, options);
+  fclose(file);
 }
 
-void List::Clear() {
-  ListNode *node = head;
-  while (node) {
-    ListNode *next = node->next;
-    delete node;
-    node = next;
+void DeserializeFromPath(List &list, const char *path,
+                         const DeserializeOptions &options =
+                             DeserializeOptions()) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    throw std::runtime_error("Can't open file for reading");
   }
-  head = nullptr;
-  tail = nullptr;
-  count = 0;
+  list.Deserialize(file, options);
+  fclose(file);
 }
 
-List::~List() { Clear(); }
+ssize_t CountWrite(void *calls, const char *, size_t size) {
+  ++*static_cast<size_t *>(calls);
+  return static_cast<ssize_t>(size);
+}
 
-void List::PrintList() {
-  ListNode *node = head;
-  uint32_t index = 0;
-  while (node) {
-    std::cout << "Node " << index << ": data = " << node->data << ", rand = ";
-    if (node->rand)
-      std::cout << node->rand->data;
-    else
-      std::cout << "nullptr";
-    std::cout << std::endl;
-    node = node->next;
-    ++index;
+// An unbuffered stream that drops its bytes and counts the writes reaching
+// it: one per fwrite call.
+FILE *OpenCountingStream(size_t &calls) {
+  cookie_io_functions_t io = {nullptr, CountWrite, nullptr, nullptr};
+  FILE *stream = fopencookie(&calls, "w", io);
+  if (!stream) {
+    throw std::runtime_error("Can't open counting stream");
   }
+  setvbuf(stream, nullptr, _IONBF, 0);
+  return stream;
 }
 
-// -------------------- Test Functions --------------------
+// Writes the benchmark records field by field (bufferSize 0) or through a
+// WriteBuffer. Timing this instead of Serialize leaves out the node-to-index
+// map, which costs more than the writes themselves.
+void WriteBenchmarkRecords(FILE *file, const std::vector<std::string> &payloads,
+                           const std::vector<int32_t> &rands,
+                           size_t bufferSize) {
+  FileSink sink(file);
+  WriteBuffer out(sink, bufferSize);
+  auto write = [&](const void *bytes, size_t size) {
+    if (bufferSize == 0) {
+      fwrite(bytes, 1, size, file);
+    } else {
+      out.Write(bytes, size, "Error writing benchmark list...stopped");
+    }
+  };
+  uint32_t count = static_cast<uint32_t>(payloads.size());
+  write(&count, sizeof(count));
+  for (size_t i = 0; i < payloads.size(); i++) {
+    uint32_t dataSize = static_cast<uint32_t>(payloads[i].size());
+    write(&dataSize, sizeof(dataSize));
+    write(payloads[i].data(), dataSize);
+    write(&rands[i], sizeof(rands[i]));
+  }
+  out.Flush();
+}
 
-void TestEmptyList() {
+// fwrite calls per list: 3n + 1 field by field, about bytes / bufferSize
+// through WriteBuffer. The counts come from Serialize itself.
+void BenchmarkBufferedWriter(int n) {
   List list;
+  LoadBenchmarkList(list, n);
+  std::vector<std::string> payloads;
+  std::vector<int32_t> rands;
+  for (int i = 0; i < n; i++) {
+    payloads.push_back("payload-" + std::to_string(i % 1000));
+    rands.push_back(i % 2 ? -1
+                          : static_cast<int32_t>((int64_t{i} * 7919) % n));
+  }
 
-  {
-    FILE *file = fopen("temp_empty.dat", "wb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for writing...stopped");
+  for (size_t bufferSize : {size_t{0}, size_t{4096}, size_t{64} << 10,
+                            size_t{1} << 20}) {
+    size_t calls = 0;
+    FILE *counting = OpenCountingStream(calls);
+    if (bufferSize == 0) {
+      WriteBenchmarkList(counting, n);
+    } else {
+      SerializeOptions options;
+      options.bufferSize = bufferSize;
+      list.Serialize(counting, options);
     }
-    list.Serialize(file);
-    fclose(file);
+    fclose(counting);
+    double seconds = BestOfThree([&] {
+      FILE *file = fopen("bench.dat", "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open file for writing");
+      }
+      WriteBenchmarkRecords(file, payloads, rands, bufferSize);
+      fclose(file);
+    });
+    if (bufferSize == 0) {
+      std::cout << "  field by field: ";
+    } else {
+      std::cout << "  bufferSize " << bufferSize << ": ";
+    }
+    std::cout << calls << " fwrite calls, write " << seconds << " s"
+              << std::endl;
   }
+  remove("bench.dat");
+}
 
-  List deserialized;
-  {
-    FILE *file = fopen("temp_empty.dat", "rb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for reading...stopped");
+// Serialize into a stream that drops its bytes, so the time is the walk and
+// the rand index lookups rather than the disk.
+void BenchmarkIndexResolution(int n) {
+  List list;
+  LoadBenchmarkList(list, n);
+  size_t calls = 0;
+  FILE *discard = OpenCountingStream(calls);
+  double seconds = BestOfThree([&] { list.Serialize(discard); });
+  fclose(discard);
+  std::cout << "  Serialize " << seconds << " s" << std::endl;
+}
+
+// Columnar Deserialize with 1 to 16 worker threads, through the mapping and
+// through FILE*. Speedups are against one thread on the same path.
+void BenchmarkParallelDeserialize(int n) {
+  List list;
+  LoadBenchmarkList(list, n);
+  SerializeOptions options;
+  options.format = Format::Columnar;
+  SerializeToPath(list, "bench.dat", options);
+  std::cout << "  hardware threads: " << std::thread::hardware_concurrency()
+            << std::endl;
+  for (bool mapped : {true, false}) {
+    double single = 0;
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u}) {
+      DeserializeOptions loadOptions;
+      loadOptions.threads = threads;
+      double seconds = BestOfThree([&] {
+        List loaded;
+        if (mapped) {
+          loaded.Deserialize(std::string("bench.dat"), loadOptions);
+        } else {
+          FILE *file = fopen("bench.dat", "rb");
+          if (!file) {
+            throw std::runtime_error("Can't open file for reading");
+          }
+          loaded.Deserialize(file, loadOptions);
+          fclose(file);
+        }
+      });
+      if (threads == 1) {
+        single = seconds;
+      }
+      std::cout << "  " << (mapped ? "mapped" : "FILE*") << ", threads "
+                << threads << ": " << seconds << " s, speedup "
+                << single / seconds << std::endl;
     }
-    deserialized.Deserialize(file);
-    fclose(file);
   }
-  assert(deserialized.GetCount() == 0);
-  std::cout << "TestEmptyList passed" << std::endl;
+  remove("bench.dat");
 }
 
-void TestSingleNode() {
+// File size and mapped load time of fixed-width against varint columnar
+// fields.
+void BenchmarkVarintEncoding(int n) {
   List list;
-  list.AddNode("SingleNode");
-  list.SetRand(0, 0); // self-reference
-  {
-    FILE *file = fopen("temp_single.dat", "wb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for writing");
+  LoadBenchmarkList(list, n);
+  for (bool varint : {false, true}) {
+    SerializeOptions options;
+    options.format = Format::Columnar;
+    options.varint = varint;
+    SerializeToPath(list, "bench.dat", options);
+    struct stat info;
+    if (stat("bench.dat", &info) != 0) {
+      throw std::runtime_error("Can't stat benchmark file");
     }
-    list.Serialize(file);
-    fclose(file);
+    double seconds = BestOfThree([&] {
+      List loaded;
+      loaded.Deserialize(std::string("bench.dat"));
+    });
+    std::cout << "  " << (varint ? "varint" : "fixed") << ": "
+              << info.st_size << " bytes, load " << seconds << " s ("
+              << static_cast<double>(n) / seconds / 1e6 << " M nodes/s)"
+              << std::endl;
   }
-  List deserialized;
+  remove("bench.dat");
+}
+
+// Columnar Serialize and Deserialize wall time, raw against several block
+// sizes.
+void BenchmarkBlockCompression(int n) {
+  List list;
+  LoadBenchmarkList(list, n);
+  for (size_t blockSize :
+       {size_t{0}, size_t{4096}, size_t{64} << 10, size_t{1} << 20}) {
+    SerializeOptions options;
+    options.format = Format::Columnar;
+    options.compressBlockSize = blockSize;
+    double write = BestOfThree([&] {
+      SerializeToPath(list, "bench.dat", options);
+    });
+    size_t size = ReadFileBytes("bench.dat").size();
+    double read = BestOfThree([&] {
+      List loaded;
+      DeserializeFromPath(loaded, "bench.dat");
+    });
+    DeserializeOptions parallel;
+    parallel.threads = 0;
+    double mapped = BestOfThree([&] {
+      List loaded;
+      loaded.Deserialize(std::string("bench.dat"), parallel);
+    });
+    std::cout << "  block " << blockSize << ": " << size << " bytes, write "
+              << write << " s, FILE* read " << read
+              << " s, mapped parallel read " << mapped << " s" << std::endl;
+  }
+  remove("bench.dat");
+}
+
+// File size, load time and the RSS a load adds, on a list of 250 distinct
+// 30 byte payloads.
+void BenchmarkDictionary(int n) {
+  SerializeOptions plain;
+  plain.format = Format::Columnar;
+  SerializeOptions dictionary = plain;
+  dictionary.dictionary = true;
   {
-    FILE *file = fopen("temp_single.dat", "rb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for reading");
+    List list;
+    for (int i = 0; i < n; i++) {
+      list.AddNode("tenant-" + std::to_string(i % 50) +
+                   "-corporation/status-" + std::to_string(200 + i % 5));
     }
-    deserialized.Deserialize(file);
-    fclose(file);
+    SerializeToPath(list, "bench_plain.dat", plain);
+    SerializeToPath(list, "bench_dict.dat", dictionary);
   }
-  assert(deserialized.GetCount() == 1);
-  std::cout << "TestSingleNode:" << std::endl;
-  deserialized.PrintList();
-  std::cout << "TestSingleNode passed" << std::endl;
+  for (bool dictionaryFile : {false, true}) {
+    const char *path = dictionaryFile ? "bench_dict.dat" : "bench_plain.dat";
+    std::cout << "  " << (dictionaryFile ? "dictionary" : "plain") << ": "
+              << ReadFileBytes(path).size() << " bytes" << std::endl;
+    std::cout << "    mapped: ";
+    ReportLoadInChild([&](List &list) { list.Deserialize(std::string(path)); });
+    std::cout << "    FILE*: ";
+    ReportLoadInChild([&](List &list) { DeserializeFromPath(list, path); });
+    DeserializeOptions lazy;
+    lazy.payloads = PayloadMode::Lazy;
+    std::cout << "    mapped, lazy: ";
+    ReportLoadInChild(
+        [&](List &list) { list.Deserialize(std::string(path), lazy); });
+  }
+  remove("bench_plain.dat");
+  remove("bench_dict.dat");
 }
 
-void TestMultipleNodes() {
+// A full load against opening a SerializedListReader and 1000 random reads.
+void BenchmarkRandomAccess(int n) {
   List list;
-  list.AddNode("Node1");
-  list.AddNode("Node2");
-  list.AddNode("Node3");
-  list.AddNode("Node4");
-  list.AddNode("Node5");
-  list.SetRand(0, 2);
-  list.SetRand(1, 4);
-  list.SetRand(2, 0);
-  list.SetRand(3, 3);
-  list.SetRand(4, 1);
+  LoadBenchmarkList(list, n);
+  SerializeOptions footer;
+  footer.indexStride = 1024;
+  SerializeOptions columnar;
+  columnar.format = Format::Columnar;
+  SerializeOptions varint = columnar;
+  varint.varint = true;
+  varint.chunkNodes = 1024;
+  const char *names[] = {"interleaved, no footer", "interleaved, footer 1024",
+                         "columnar fixed, chunk 64K",
+                         "columnar varint, chunk 1K"};
+  int k = 0;
+  for (const SerializeOptions &options :
+       {SerializeOptions(), footer, columnar, varint}) {
+    SerializeToPath(list, "bench.dat", options);
+    double load = BestOfThree([&] {
+      List loaded;
+      loaded.Deserialize(std::string("bench.dat"));
+    });
+    double open = BestOfThree([&] { SerializedListReader("bench.dat"); });
+    SerializedListReader reader("bench.dat");
+    size_t bytes = 0;
+    double reads = BestOfThree([&] {
+      uint32_t state = 1;
+      for (int q = 0; q < 1000; q++) {
+        state = state * 1103515245 + 12345;
+        bytes += reader.Read(state % static_cast<uint32_t>(n)).data.size();
+      }
+    });
+    std::cout << "  " << names[k++] << ": full load " << load << " s, open "
+              << open << " s, 1000 reads " << reads << " s" << std::endl;
+  }
+  remove("bench.dat");
+}
 
-  {
-    FILE *file = fopen("temp_multiple.dat", "wb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for writing");
+// 64 MiB lists of one payload size each. A threshold no payload reaches
+// still takes the descriptor path, without gathering.
+void BenchmarkGatheredWrites() {
+  for (size_t payload : {size_t{64}, size_t{512}, size_t{4096},
+                         size_t{64} << 10}) {
+    List list;
+    size_t n = (size_t{64} << 20) / payload;
+    for (size_t i = 0; i < n; i++) {
+      list.AddNode(std::string(payload, static_cast<char>('a' + i % 26)));
     }
-    list.Serialize(file);
-    fclose(file);
+    SerializeOptions copied;
+    SerializeOptions descriptor;
+    descriptor.gatherThreshold = SIZE_MAX;
+    SerializeOptions gathered;
+    gathered.gatherThreshold = 256;
+    double seconds[3] = {};
+    int column = 0;
+    for (const SerializeOptions *options : {&copied, &descriptor, &gathered}) {
+      seconds[column++] = BestOfThree(
+          [&] { SerializeToPath(list, "bench.dat", *options); });
+    }
+    std::cout << "  payload " << payload << ": fwrite " << seconds[0]
+              << " s, pwrite " << seconds[1] << " s, pwritev " << seconds[2]
+              << " s" << std::endl;
   }
-  List deserialized;
-  {
-    FILE *file = fopen("temp_multiple.dat", "rb");
-    if (!file) {
-      throw std::runtime_error("Can't open file for reading...stopped");
+  unlink("bench.dat");
+}
+
+// Building lists of growing size with one random SetRand call per node.
+void BenchmarkSetRand(int maxNodes) {
+  for (int n = 10000; n <= maxNodes; n *= 10) {
+    List list;
+    for (int i = 0; i < n; i++) {
+      list.AddNode(std::to_string(i));
     }
-    deserialized.Deserialize(file);
-    fclose(file);
+    auto start = std::chrono::steady_clock::now();
+    uint32_t state = 12345;
+    for (int i = 0; i < n; i++) {
+      state = state * 1103515245 + 12345;
+      int from = static_cast<int>(state % n);
+      state = state * 1103515245 + 12345;
+      list.SetRand(from, static_cast<int>(state % n));
+    }
+    double seconds = SecondsSince(start);
+    std::cout << "  " << n << " nodes: " << seconds << " s, "
+              << seconds / n * 1e9 << " ns per SetRand" << std::endl;
   }
-  assert(deserialized.GetCount() == 5);
-  std::cout << "TestMultipleNodes:" << std::endl;
-  deserialized.PrintList();
-  std::cout << "TestMultipleNodes passed" << std::endl;
+}
+
+void RunBenchmarks(int n) {
+  std::cout << "Running benchmarks with " << n << " nodes..." << std::endl;
+  std::cout << "Buffered writer" << std::endl;
+  BenchmarkBufferedWriter(n);
+  std::cout << "Rand index resolution" << std::endl;
+  BenchmarkIndexResolution(n);
+  std::cout << "Parallel columnar Deserialize" << std::endl;
+  BenchmarkParallelDeserialize(n);
+  std::cout << "Varint encoding" << std::endl;
+  BenchmarkVarintEncoding(n);
+  std::cout << "Block compression" << std::endl;
+  BenchmarkBlockCompression(n);
+  std::cout << "Dictionary encoding" << std::endl;
+  BenchmarkDictionary(n);
+  std::cout << "Random access" << std::endl;
+  BenchmarkRandomAccess(n);
+  std::cout << "Gathered writes" << std::endl;
+  BenchmarkGatheredWrites();
+  std::cout << "SetRand" << std::endl;
+  BenchmarkSetRand(n);
 }
 
 // -------------------- Main Function --------------------
 
-int main() {
+int main(int argc, char **argv) {
   try {
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+      RunBenchmarks(argc > 2 ? std::stoi(argv[2]) : 1000000);
+      return 0;
+    }
     std::cout << "Running tests..." << std::endl;
     TestEmptyList();
     TestSingleNode();
     TestMultipleNodes();
+    TestBufferedWriter();
+    TestMappedDeserialize();
+    TestArenaBlocks();
+    TestRandIndexRoundTrip();
+    TestColumnarFormat();
+    TestParallelDeserialize();
+    TestParallelSerialize();
+    TestVarintEncoding();
+    TestRandDeltaEncoding();
+    TestBlockCompression();
+    TestDictionaryEncoding();
+    TestLazyPayloads();
+    TestRandomAccess();
+    TestStreamingRead();
+    TestSkeletonLoad();
+    TestFilteredDeserialize();
+    TestSinksAndSources();
+    TestMemoryBuffers();
+    TestGatheredWrites();
+    TestAsyncSerialize();
+    TestPositionalAccess();
+    TestSetRandBatch();
+    TestFromRange();
+    TestAddNodeAllocations();
+    TestIndexedList();
+    TestEmptyColumnarList();
   } catch (const std::exception &ex) {
     std::cerr << "Test failed: " << ex.what() << std::endl;
     return 1;